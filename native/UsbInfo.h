@@ -4,12 +4,17 @@
 #include <linux/types.h>
 #include <linux/ioctl.h>
 
-#define CMD_GET_STATUS	_IOR(0xFF, 123, unsigned char) 
+// Records and ioctls shared with usb_driver.c;
+#include "../usb_monitor_abi.h"
 
 #define DEV_NAME "/proc/usb_monitor"
 
 #define MAX_EPOLL_EVENTS         1
-#define KERNEL_DATA_LENG        128
+#define KERNEL_MESSAGE_SIZE     (sizeof(struct usb_message_t))
+
+// One read() drains up to this many messages;
+#define KERNEL_BATCH_COUNT       64
+#define KERNEL_DATA_LENG        (KERNEL_MESSAGE_SIZE * KERNEL_BATCH_COUNT)
 #define MONITOR_DISABLE       0x00
 #define MONITOR_ENABLE        0xff
 
@@ -19,6 +24,12 @@ struct DataInfo{
     uint8_t kernel_time[8];       //8 Byte 
     uint8_t status;               //1 byte
     int8_t  name[128];            //128 byte
+    uint16_t vendor;              //idVendor
+    uint16_t product;             //idProduct
+    uint16_t busnum;              //总线号
+    uint8_t  devnum;              //设备号
+    uint8_t  speed;               //enum usb_device_speed
+    int8_t  serial[32];           //序列号, 以 0 结尾
 };
 
 class UsbMonitorInfo {
@@ -101,7 +101,7 @@ private:
     int mEpollfd;
     struct epoll_event mEpev;
     char *mDev_name;
-    char mBuf[50];
+    char mBuf[KERNEL_DATA_LENG];
     RingBuffer<UsbMonitorInfo> mRingBuffer;
 };
 
@@ -109,7 +109,7 @@ private:
 static void * DoUsbMonitor(void *arg){
         int ret;
         //static int index = 0;
-        ssize_t leng = 0, i = 0;
+        ssize_t leng = 0, i = 0, offset = 0;
         struct epoll_event epev;
         UsbMonitorInfo deviceinfo;
         UsbMonitorDevice* device = (UsbMonitorDevice*)arg;
@@ -123,23 +123,38 @@ static void * DoUsbMonitor(void *arg){
 //                 printf("usb_monitor epoll_wait failed; errno=%d\n", errno);
 //                 return (void*)(-1);
 //             }
-            leng  = read(device->getFd(), buf, KERNEL_DATA_LENG); //MAX 32 Byte
+            leng  = read(device->getFd(), buf, KERNEL_DATA_LENG); //MAX KERNEL_BATCH_COUNT messages
             if (leng > 0){
                 printf("Reading length is %d\n",leng);
+            }
+            // 被信号打断或暂无数据 (EINTR/EAGAIN) 时返回 -1, 重新读取
+            if (leng <= 0){
+                continue;
+            }
+            // 驱动只返回完整的消息
+            for (offset = 0; offset + KERNEL_MESSAGE_SIZE <= (size_t)leng; offset += KERNEL_MESSAGE_SIZE){
+                const struct usb_message_t* message = (const struct usb_message_t*)(buf + offset);
                 //8 字节的 kernel time
+                memcpy(deviceinfo.info.kernel_time, &message->kernel_time, 8);
                 for (i = 0; i < 8; i++){
-                    deviceinfo.info.kernel_time[i] = buf[i];
                     printf("kernel_time[%d] = 0x%x \n", i, deviceinfo.info.kernel_time[i]);
                 }
                 // 记录插拔状态
-                deviceinfo.info.status = buf[8];
-                // 拷贝USB名称
-                memcpy(deviceinfo.info.name, buf+9,leng-9);
+                deviceinfo.info.status = message->plug_flag;
+                // 拷贝USB名称, 驱动保证以 0 结尾
+                memcpy(deviceinfo.info.name, message->usb_name, USB_MONITOR_NAME_LENG);
+                // 驱动在插拔时已记录设备信息, 不需要再查 sysfs
+                deviceinfo.info.vendor = message->vendor;
+                deviceinfo.info.product = message->product;
+                deviceinfo.info.busnum = message->busnum;
+                deviceinfo.info.devnum = message->devnum;
+                deviceinfo.info.speed = message->speed;
+                memcpy(deviceinfo.info.serial, message->serial, USB_MONITOR_SERIAL_LENG);
     
                 if(deviceinfo.info.status==1){
-                    printf("USB %s -> plug In \n",deviceinfo.info.name);
+                    printf("USB %s %04x:%04x -> plug In \n",deviceinfo.info.name,deviceinfo.info.vendor,deviceinfo.info.product);
                 }else{
-                    printf("USB %s -> plug Out \n",deviceinfo.info.name);
+                    printf("USB %s %04x:%04x -> plug Out \n",deviceinfo.info.name,deviceinfo.info.vendor,deviceinfo.info.product);
                 }
                 printf("\n");
 
@@ -12,27 +12,39 @@
 #include <linux/types.h>
 #include <linux/ioctl.h>
 #include <stddef.h>
+#include "../usb_monitor_abi.h"
 
 #define DEV_NAME "/proc/usb_monitor"
 
 size_t BUFFER_SIZE = 512;
 
-#define KERNEL_DATA_LENG        128
+// struct usb_message_t 定义在 usb_monitor_abi.h 中, 与驱动共用
+#define KERNEL_MESSAGE_SIZE     (sizeof(struct usb_message_t))
+
+// 一次 read 最多读取的消息数
+#define KERNEL_BATCH_COUNT       64
+#define KERNEL_DATA_LENG        (KERNEL_MESSAGE_SIZE * KERNEL_BATCH_COUNT)
 
 // 定义所用信息的结构体
 struct DataInfo{
     unsigned char kernel_time[8];       //8 Byte 
     unsigned char status;               //1 Byte
     char name[128];                         //unknow
+    unsigned short vendor;              //idVendor
+    unsigned short product;             //idProduct
+    unsigned short busnum;              //总线号
+    unsigned char  devnum;              //设备号
+    unsigned char  speed;               //enum usb_device_speed
+    char serial[32];                    //序列号, 以 0 结尾
 }data_info;
 
 
 int main(){
 
     int mFd,i=0;
-    int leng = 0;
+    int leng = 0, offset = 0;
     // 初始化读取缓存 
-    char mBuf[128];
+    char mBuf[KERNEL_DATA_LENG];
     // 打开/proc/usb_monitor 文件准备进行读取
     mFd = open(DEV_NAME, O_RDWR); 
     if (mFd == -1) {
@@ -45,20 +57,35 @@ int main(){
         leng = read(mFd, mBuf, KERNEL_DATA_LENG);
         if ( leng > 0 ){
             printf("read length is %d\n",leng);
+        }
+        // 被信号打断或暂无数据 (EINTR/EAGAIN) 时返回 -1, 重新读取
+        if (leng <= 0){
+            continue;
+        }
+        // 驱动只返回完整的消息
+        for (offset = 0; offset + KERNEL_MESSAGE_SIZE <= (size_t)leng; offset += KERNEL_MESSAGE_SIZE){
+            const struct usb_message_t* message = (const struct usb_message_t*)(mBuf + offset);
             //8 字节的 kernel time
+            memcpy(data_info.kernel_time, &message->kernel_time, 8);
             for (i = 0; i < 8; i++){
-                data_info.kernel_time[i] = mBuf[i];
                 printf("kernel_time[%d] = 0x%x \n", i, data_info.kernel_time[i]);
             }
             // 记录插拔状态
-            data_info.status = mBuf[8];
-            // 拷贝USB名称
-            memcpy(data_info.name,mBuf+9,leng-9);
+            data_info.status = message->plug_flag;
+            // 拷贝USB名称, 驱动保证以 0 结尾
+            memcpy(data_info.name, message->usb_name, USB_MONITOR_NAME_LENG);
+            // 驱动在插拔时已记录设备信息, 不需要再查 sysfs
+            data_info.vendor = message->vendor;
+            data_info.product = message->product;
+            data_info.busnum = message->busnum;
+            data_info.devnum = message->devnum;
+            data_info.speed = message->speed;
+            memcpy(data_info.serial, message->serial, USB_MONITOR_SERIAL_LENG);
 
             if(data_info.status==1){
-                printf("USB %s -> plug In \n",data_info.name);
+                printf("USB %s %04x:%04x -> plug In \n",data_info.name,data_info.vendor,data_info.product);
             }else{
-                printf("USB %s -> plug Out \n",data_info.name);
+                printf("USB %s %04x:%04x -> plug Out \n",data_info.name,data_info.vendor,data_info.product);
             }
             printf("\n");
         }
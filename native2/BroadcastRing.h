@@ -0,0 +1,257 @@
+#ifndef __BROADCAST_RING_H_
+#define __BROADCAST_RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <climits>
+#include <type_traits>
+#include <vector>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+// Single-producer ring broadcast to several subscribers.
+//
+// The producer publishes each value once; every subscriber reads it through
+// its own cursor, so adding a subscriber adds neither a copy nor a lock. The
+// producer never waits for subscribers: one that falls a whole lap behind
+// loses the values that were overwritten, and Take reports how many. Values
+// are copied out and then checked against the producer's claim, like a
+// seqlock, so T must be trivially copyable.
+//
+// Each subscriber picks how it waits for the next value: spinning, yielding
+// the CPU, or sleeping on a futex that the producer only wakes when someone
+// sleeps on it.
+template <typename T>
+class BroadcastRing {
+    static_assert(std::is_trivially_copyable<T>::value, "values are copied while they may be overwritten");
+
+ public:
+    enum WaitStrategy { WAIT_SPIN, WAIT_YIELD, WAIT_FUTEX };
+
+    static const int kMaxSubscribers = 8;
+
+    BroadcastRing() { Reset(1024); }
+
+    explicit BroadcastRing(size_t capacity) { Reset(capacity); }
+
+    BroadcastRing(const BroadcastRing& other) = delete;
+    BroadcastRing& operator=(const BroadcastRing& other) = delete;
+
+    // Any thread. The subscriber starts at the oldest value still held, so
+    // one added just after publishing started misses nothing. Returns its
+    // id, or -1 when kMaxSubscribers are taken.
+    int Subscribe(WaitStrategy wait) {
+        int id = subscriber_count_.load(std::memory_order_relaxed);
+        do {
+            if (id == kMaxSubscribers)
+                return -1;
+        } while (!subscriber_count_.compare_exchange_weak(id, id + 1));
+
+        uint64_t published = published_.load(std::memory_order_acquire);
+        Subscriber& sub = subscribers_[id];
+        sub.wait = wait;
+        sub.lost.store(0, std::memory_order_relaxed);
+        sub.cursor.store(published > buffer_.size() ? published - buffer_.size() : 0,
+                         std::memory_order_release);
+        return id;
+    }
+
+    // Producer side, never blocks.
+    void Append(const T& val) { AppendBatch(&val, 1); }
+
+    // Returns count.
+    size_t AppendBatch(const T* vals, size_t count) {
+        size_t done = 0;
+        while (done < count) {
+            size_t n = count - done < buffer_.size() ? count - done : buffer_.size();
+            uint64_t published = published_.load(std::memory_order_relaxed);
+
+            // Readers of the slots about to be overwritten must see the claim
+            // before any of the new values.
+            claimed_.store(published + n, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            for (size_t i = 0; i < n; i++)
+                buffer_[(published + i) & mask_] = vals[done + i];
+            published_.store(published + n, std::memory_order_release);
+            done += n;
+        }
+
+        // Pairs with the fence in Wait, either the sleeper sees the new values
+        // or we see it sleeping.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers_.load(std::memory_order_relaxed) > 0) {
+            futex_word_.fetch_add(1, std::memory_order_relaxed);
+            Futex(FUTEX_WAKE_PRIVATE, INT_MAX);
+        }
+        return count;
+    }
+
+    // Subscriber side. Copies up to count values and advances the cursor,
+    // never blocks. Values overwritten before they could be read are skipped
+    // and added to *lost.
+    size_t Poll(int id, T* vals, size_t count, uint64_t* lost) {
+        Subscriber& sub = subscribers_[id];
+        uint64_t cursor = sub.cursor.load(std::memory_order_relaxed);
+        uint64_t published = published_.load(std::memory_order_acquire);
+
+        if (published - cursor > buffer_.size()) {
+            Lapped(sub, published - buffer_.size() - cursor, lost);
+            cursor = published - buffer_.size();
+        }
+        if (count > published - cursor)
+            count = published - cursor;
+        for (size_t i = 0; i < count; i++)
+            memcpy(&vals[i], &buffer_[(cursor + i) & mask_], sizeof(T));
+
+        // Drop the values the producer started overwriting while we copied.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t claimed = claimed_.load(std::memory_order_relaxed);
+        size_t skip = 0;
+        if (claimed > cursor + buffer_.size()) {
+            skip = claimed - buffer_.size() - cursor;
+            if (skip > count)
+                skip = count;
+            Lapped(sub, skip, lost);
+            memmove(vals, vals + skip, (count - skip) * sizeof(T));
+        }
+
+        sub.cursor.store(cursor + count, std::memory_order_release);
+        return count - skip;
+    }
+
+    // Like Poll but waits with the subscriber's strategy until there is
+    // something to read; 0 only after Shutdown.
+    size_t Take(int id, T* vals, size_t count, uint64_t* lost) {
+        while (true) {
+            size_t n = Poll(id, vals, count, lost);
+            if (n > 0)
+                return n;
+            if (!Wait(id))
+                return Poll(id, vals, count, lost);
+        }
+    }
+
+    // Wake every waiting subscriber and make Take return once drained.
+    void Shutdown() {
+        shutdown_.store(true, std::memory_order_seq_cst);
+        futex_word_.fetch_add(1, std::memory_order_relaxed);
+        Futex(FUTEX_WAKE_PRIVATE, INT_MAX);
+    }
+
+    // Values the slowest subscriber has still to read, at most the capacity.
+    size_t GetSize() const {
+        uint64_t published = published_.load(std::memory_order_acquire);
+        size_t size = 0;
+        int n = subscriber_count_.load(std::memory_order_acquire);
+        for (int i = 0; i < n; i++) {
+            uint64_t lag = published - subscribers_[i].cursor.load(std::memory_order_acquire);
+            if (lag > size)
+                size = lag;
+        }
+        return size < buffer_.size() ? size : buffer_.size();
+    }
+
+    bool IsEmpty() const { return GetSize() == 0; }
+
+    size_t GetCapacity() const { return buffer_.size(); }
+
+    uint64_t GetLost(int id) const {
+        return subscribers_[id].lost.load(std::memory_order_relaxed);
+    }
+
+    // Not thread safe, only before publishing starts.
+    void Reset(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        buffer_.clear();
+        buffer_.resize(size);
+        mask_ = size - 1;
+        published_.store(0, std::memory_order_relaxed);
+        claimed_.store(0, std::memory_order_relaxed);
+        int n = subscriber_count_.load(std::memory_order_relaxed);
+        for (int i = 0; i < n; i++)
+            subscribers_[i].cursor.store(0, std::memory_order_relaxed);
+        shutdown_.store(false, std::memory_order_relaxed);
+    }
+
+ private:
+    static const size_t kCacheLine = 64;
+
+    struct alignas(kCacheLine) Subscriber {
+        std::atomic<uint64_t> cursor{0};    // Next value to read;
+        std::atomic<uint64_t> lost{0};
+        WaitStrategy wait = WAIT_FUTEX;
+    };
+
+    bool HasData(int id) const {
+        return published_.load(std::memory_order_acquire) !=
+               subscribers_[id].cursor.load(std::memory_order_relaxed);
+    }
+
+    void Lapped(Subscriber& sub, uint64_t count, uint64_t* lost) {
+        sub.lost.fetch_add(count, std::memory_order_relaxed);
+        *lost += count;
+    }
+
+    // Returns false once shut down.
+    bool Wait(int id) {
+        Subscriber& sub = subscribers_[id];
+        while (!HasData(id)) {
+            if (shutdown_.load(std::memory_order_acquire))
+                return false;
+
+            switch (sub.wait) {
+            case WAIT_SPIN:
+                CpuRelax();
+                break;
+            case WAIT_YIELD:
+                sched_yield();
+                break;
+            case WAIT_FUTEX: {
+                uint32_t word = futex_word_.load(std::memory_order_relaxed);
+                sleepers_.fetch_add(1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (!HasData(id) && !shutdown_.load(std::memory_order_relaxed))
+                    FutexWait(word);
+                sleepers_.fetch_sub(1, std::memory_order_relaxed);
+                break;
+            }
+            }
+        }
+        return true;
+    }
+
+    static inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+
+    void FutexWait(uint32_t word) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&futex_word_), FUTEX_WAIT_PRIVATE, word,
+                NULL, NULL, 0);
+    }
+
+    void Futex(int op, int count) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&futex_word_), op, count, NULL, NULL, 0);
+    }
+
+    std::vector<T> buffer_;
+    size_t mask_ = 0;
+    std::atomic<int> subscriber_count_{0};
+    std::atomic<bool> shutdown_{false};
+    // Written by the producer.
+    alignas(kCacheLine) std::atomic<uint64_t> published_{0};
+    std::atomic<uint64_t> claimed_{0};
+    // Touched only when a subscriber sleeps.
+    alignas(kCacheLine) std::atomic<uint32_t> futex_word_{0};
+    std::atomic<int> sleepers_{0};
+    Subscriber subscribers_[kMaxSubscribers];
+};
+
+#endif
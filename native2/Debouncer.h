@@ -0,0 +1,207 @@
+#ifndef __DEBOUNCER_H_
+#define __DEBOUNCER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "UsbInfo.h"
+
+// Coalesces plug storms of flapping devices.
+//
+// A device's first event, or one that comes after a window of quiet, passes
+// straight through. An event that comes less than a window after the
+// previous one of the same device is held instead, and so is every
+// following one until the device has been quiet for a whole window. Expire
+// then emits only the latest held record, with flaps set to the number of
+// held records it replaced. A marginal cable bouncing a hundred times costs
+// the consumers two events.
+//
+// A device is identified by its name, serial, vendor, product and bus; devnum
+// changes with every re-enumeration so it is left out. Devices are kept in a
+// fixed size open addressing table, so Push is O(1) and memory is bounded;
+// once maxDevices are known, new devices pass through undebounced. Held
+// devices are chained in the order of their last event, so Expire only
+// looks at the ones that are due.
+//
+// Not thread safe, everything runs on the reader thread.
+class Debouncer {
+public:
+    static constexpr int32_t NONE = -1;
+
+    Debouncer(int64_t window, size_t maxDevices = DEBOUNCE_MAX_DEVICES){
+        size_t size = 1;
+        while (size < maxDevices * 2){
+            size <<= 1;
+        }
+        mSlots.assign(size, NONE);
+        mMaxDevices = maxDevices;
+        mEntries.reserve(maxDevices);
+        mWindow = window;
+        mFirst = mLast = NONE;
+        mHeld = 0;
+        mPassed = mCoalesced = mSummaries = 0;
+    }
+
+    // In ns of kernel_time, 0 lets everything through; held devices are
+    // emitted by the next Expire once quiet for the new window;
+    void SetWindow(int64_t window) { mWindow = window; }
+
+    int64_t GetWindow() { return mWindow; };
+
+    // True if the record goes on now, false if it is held;
+    bool Push(const UsbMonitorInfo& deviceinfo){
+        int32_t e = Lookup(deviceinfo.info);
+        if (e == NONE){
+            mPassed++;
+            return true;
+        }
+
+        Entry& entry = mEntries[e];
+        int64_t time = deviceinfo.info.kernel_time;
+        if (!entry.held){
+            bool quiet = !entry.seen || mWindow == 0 || time - entry.last_time >= mWindow;
+            entry.seen = true;
+            entry.last_time = time;
+            if (quiet){
+                mPassed++;
+                return true;
+            }
+            entry.held = true;
+            entry.flaps = 0;
+            mHeld++;
+        }else{
+            // A held device keeps its later events too, so its order holds;
+            Unlink(e);
+            entry.flaps++;
+            mCoalesced++;
+            entry.last_time = time;
+        }
+        entry.latest = deviceinfo;
+        Link(e);
+        return false;
+    }
+
+    // Emit the held devices quiet for a window at now, same clock as kernel_time;
+    template <typename Fn>
+    void Expire(int64_t now, Fn emit){
+        while (mFirst != NONE && (mWindow == 0 || now - mEntries[mFirst].last_time >= mWindow)){
+            Emit(mFirst, emit);
+        }
+    }
+
+    // Emit every held device;
+    template <typename Fn>
+    void Flush(Fn emit){
+        while (mFirst != NONE){
+            Emit(mFirst, emit);
+        }
+    }
+
+    size_t GetHeldCount() { return mHeld; };
+    uint64_t GetPassedCount() { return mPassed; };
+    uint64_t GetCoalescedCount() { return mCoalesced; };
+    uint64_t GetSummaryCount() { return mSummaries; };
+
+private:
+    struct Entry {
+        UsbMonitorInfo latest;      // Held record, or the last one seen to identify the device;
+        int64_t  last_time;         // kernel_time of the last event;
+        uint32_t flaps;             // Held records replaced by latest;
+        bool     seen;
+        bool     held;
+        int32_t  prev, next;        // Held list, oldest last_time first;
+    };
+
+    static uint64_t Hash(const struct usb_message_t& info){
+        uint64_t w[8];
+        memcpy(w, info.usb_name, sizeof(info.usb_name));
+        memcpy(w + 4, info.serial, sizeof(info.serial));
+        uint64_t hash = ((uint64_t)info.vendor << 32 | (uint64_t)info.product << 16 | info.busnum) *
+                        0x9e3779b97f4a7c15ull;
+        for (int i = 0; i < 8; i++){
+            hash = (hash ^ w[i]) * 0xc2b2ae3d27d4eb4full;
+        }
+        return hash ^ (hash >> 29);
+    }
+
+    static bool Same(const struct usb_message_t& a, const struct usb_message_t& b){
+        return a.vendor == b.vendor && a.product == b.product && a.busnum == b.busnum &&
+               memcmp(a.usb_name, b.usb_name, sizeof(a.usb_name)) == 0 &&
+               memcmp(a.serial, b.serial, sizeof(a.serial)) == 0;
+    }
+
+    // Entry of the device, a new one if there is room, else NONE;
+    int32_t Lookup(const struct usb_message_t& info){
+        size_t mask = mSlots.size() - 1;
+        for (size_t i = Hash(info) & mask; ; i = (i + 1) & mask){
+            int32_t e = mSlots[i];
+            if (e != NONE){
+                if (Same(mEntries[e].latest.info, info)){
+                    return e;
+                }
+                continue;
+            }
+            if (mEntries.size() == mMaxDevices){
+                return NONE;
+            }
+            mEntries.resize(mEntries.size() + 1);
+            Entry& entry = mEntries.back();
+            memset(&entry, 0, sizeof(entry));
+            entry.latest.info = info;
+            entry.prev = entry.next = NONE;
+            mSlots[i] = (int32_t)(mEntries.size() - 1);
+            return mSlots[i];
+        }
+    }
+
+    template <typename Fn>
+    void Emit(int32_t e, Fn emit){
+        Entry& entry = mEntries[e];
+        Unlink(e);
+        entry.held = false;
+        mHeld--;
+        mSummaries++;
+        entry.latest.info.flaps = entry.flaps > 0xffff ? 0xffff : (uint16_t)entry.flaps;
+        emit(entry.latest);
+    }
+
+    // At the tail, last_time only grows;
+    void Link(int32_t e){
+        mEntries[e].prev = mLast;
+        mEntries[e].next = NONE;
+        if (mLast != NONE){
+            mEntries[mLast].next = e;
+        }else{
+            mFirst = e;
+        }
+        mLast = e;
+    }
+
+    void Unlink(int32_t e){
+        Entry& entry = mEntries[e];
+        if (entry.prev != NONE){
+            mEntries[entry.prev].next = entry.next;
+        }else{
+            mFirst = entry.next;
+        }
+        if (entry.next != NONE){
+            mEntries[entry.next].prev = entry.prev;
+        }else{
+            mLast = entry.prev;
+        }
+        entry.prev = entry.next = NONE;
+    }
+
+    std::vector<int32_t> mSlots;    // Power of two, NONE or an entry;
+    std::vector<Entry> mEntries;    // Reserved, never moves;
+    size_t mMaxDevices;
+    int64_t mWindow;
+    int32_t mFirst, mLast;          // Held list;
+    size_t mHeld;
+    uint64_t mPassed;
+    uint64_t mCoalesced;            // Held records replaced by a later one;
+    uint64_t mSummaries;
+};
+
+#endif
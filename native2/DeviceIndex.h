@@ -0,0 +1,186 @@
+#ifndef __DEVICE_INDEX_H_
+#define __DEVICE_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "UsbInfo.h"
+
+// Current state of every device seen, kept up to date as events are appended.
+//
+// A device is its product name and serial number, both as NameTable ids, so
+// two of the same stick plugged in together keep separate states. A device
+// without a serial number is known by its model instead, vendor, product
+// and bus, which survive a re-plug unlike devnum, so the index stays bounded
+// by the devices there are; identical ones on one bus share a state. States
+// are numbered densely as they
+// are first seen and live in a vector; an open addressing table maps the
+// identity to the number, so Update and Find are a hash probe and an array
+// access. States are never removed and never move, which lets the attached
+// ones be chained into an intrusive list for ForEachAttached.
+//
+// position is the number of events appended before this one. The index does
+// not follow evictions; the owner of the fifo compares position with its own
+// oldest position to tell whether the latest event is still held.
+class DeviceIndex {
+public:
+    static constexpr int32_t NONE = -1;
+
+    struct DeviceState {
+        uint32_t name_id;
+        uint32_t serial_id;
+        uint64_t model;             // Model without a serial number, else 0;
+        bool     attached;
+        int64_t  plug_in_time;      // kernel_time of the last plug in, 0 if never;
+        int64_t  plug_out_time;     // kernel_time of the last plug out, 0 if never;
+        uint64_t position;          // Of the latest event;
+        int32_t  prev, next;        // Attached list;
+    };
+
+    DeviceIndex(){
+        mSlots.assign(64, NONE);
+        mAttached = NONE;
+        mAttachedCount = 0;
+    }
+
+    // Identity of a device without a serial number, to pass to Update and
+    // Find then; never 0;
+    static uint64_t Model(uint16_t vendor, uint16_t product, uint16_t busnum){
+        return (uint64_t)1 << 48 | (uint64_t)busnum << 32 | (uint32_t)vendor << 16 | product;
+    }
+
+    void Update(const UsbMonitorEvent& event, uint64_t model, uint64_t position){
+        int32_t e = Lookup(event.name_id, event.serial_id, model);
+        if (e == NONE){
+            e = (int32_t)mEntries.size();
+            mEntries.resize(mEntries.size() + 1);
+            DeviceState& added = mEntries.back();
+            memset(&added, 0, sizeof(added));
+            added.name_id = event.name_id;
+            added.serial_id = event.serial_id;
+            added.model = model;
+            added.prev = added.next = NONE;
+            Insert(e);
+            // Keep the load factor at or below one half;
+            if (mEntries.size() * 2 > mSlots.size()){
+                Grow();
+            }
+        }
+
+        DeviceState& state = mEntries[e];
+        bool attached = event.plug_flag == 1;
+        if (attached){
+            state.plug_in_time = event.kernel_time;
+        }else{
+            state.plug_out_time = event.kernel_time;
+        }
+        state.position = position;
+
+        if (attached != state.attached){
+            if (attached){
+                Link(e);
+            }else{
+                Unlink(e);
+            }
+            state.attached = attached;
+        }
+    }
+
+    // NULL if the device was never seen;
+    const DeviceState* Find(uint32_t name_id, uint32_t serial_id, uint64_t model = 0) const {
+        int32_t e = Lookup(name_id, serial_id, model);
+        return e == NONE ? NULL : &mEntries[e];
+    }
+
+    template <typename Fn>
+    void ForEachAttached(Fn fn) const {
+        for (int32_t e = mAttached; e != NONE; e = mEntries[e].next){
+            fn(mEntries[e]);
+        }
+    }
+
+    size_t GetAttachedCount() const { return mAttachedCount; }
+
+    // Mark every device detached, keeping what is known of it, e.g. after
+    // replaying events of an earlier run;
+    void DetachAll(){
+        while (mAttached != NONE){
+            int32_t e = mAttached;
+            Unlink(e);
+            mEntries[e].attached = false;
+        }
+    }
+
+    void Clear(){
+        mEntries.clear();
+        mSlots.assign(64, NONE);
+        mAttached = NONE;
+        mAttachedCount = 0;
+    }
+
+private:
+    static uint32_t Hash(uint32_t name_id, uint32_t serial_id, uint64_t model){
+        uint64_t hash = (name_id * 0x9e3779b97f4a7c15ull) ^ (serial_id * 0xc2b2ae3d27d4eb4full) ^
+                        (model * 0x165667b19e3779f9ull);
+        return (uint32_t)(hash >> 32) ^ (uint32_t)hash;
+    }
+
+    int32_t Lookup(uint32_t name_id, uint32_t serial_id, uint64_t model) const {
+        size_t mask = mSlots.size() - 1;
+        for (size_t i = Hash(name_id, serial_id, model) & mask; ; i = (i + 1) & mask){
+            int32_t e = mSlots[i];
+            if (e == NONE || (mEntries[e].name_id == name_id && mEntries[e].serial_id == serial_id &&
+                              mEntries[e].model == model)){
+                return e;
+            }
+        }
+    }
+
+    void Insert(int32_t e){
+        size_t mask = mSlots.size() - 1;
+        size_t i = Hash(mEntries[e].name_id, mEntries[e].serial_id, mEntries[e].model) & mask;
+        while (mSlots[i] != NONE){
+            i = (i + 1) & mask;
+        }
+        mSlots[i] = e;
+    }
+
+    void Grow(){
+        mSlots.assign(mSlots.size() * 2, NONE);
+        for (int32_t e = 0; e < (int32_t)mEntries.size(); e++){
+            Insert(e);
+        }
+    }
+
+    void Link(int32_t e){
+        mEntries[e].prev = NONE;
+        mEntries[e].next = mAttached;
+        if (mAttached != NONE){
+            mEntries[mAttached].prev = e;
+        }
+        mAttached = e;
+        mAttachedCount++;
+    }
+
+    void Unlink(int32_t e){
+        DeviceState& state = mEntries[e];
+        if (state.prev != NONE){
+            mEntries[state.prev].next = state.next;
+        }else{
+            mAttached = state.next;
+        }
+        if (state.next != NONE){
+            mEntries[state.next].prev = state.prev;
+        }
+        state.prev = state.next = NONE;
+        mAttachedCount--;
+    }
+
+    std::vector<DeviceState> mEntries;  // In the order first seen;
+    std::vector<int32_t> mSlots;        // Power of two, NONE or an index into mEntries;
+    int32_t mAttached;                  // Head of the attached list;
+    size_t mAttachedCount;
+};
+
+#endif
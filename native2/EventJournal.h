@@ -0,0 +1,412 @@
+#ifndef __EVENT_JOURNAL_H_
+#define __EVENT_JOURNAL_H_
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Log.h"
+#include "UsbInfo.h"
+
+// Append-only on-disk journal of UsbMonitorInfo records.
+//
+// The journal is a directory of fixed size segment files, each preallocated
+// and mapped MAP_SHARED, so Append is a memcpy and a few stores with no
+// syscall; the kernel writes the pages back, Flush() only schedules it.
+// Crossing into a new segment is the only place that makes syscalls.
+//
+// A record is committed by storing its sequence number last, after its
+// checksum. On open the tail segment is scanned up to the first record whose
+// sequence or checksum does not match, which is where a crash stopped it.
+//
+// Every JOURNAL_INDEX_STRIDE-th record of a segment is also entered in the
+// segment's sparse time index, so Seek by kernel_time reads at most one
+// stride of records after a binary search.
+class EventJournal {
+public:
+    static const uint32_t JOURNAL_MAGIC = 0x4a425355;     // "USBJ"
+    static const uint32_t JOURNAL_VERSION = 2;
+    static const uint32_t JOURNAL_SEGMENT_RECORDS = 65536;
+    static const uint32_t JOURNAL_INDEX_STRIDE = 64;
+    static const uint32_t JOURNAL_MAX_SEGMENTS = 8;
+
+    struct Record {
+        uint64_t sequence;          // 1-based, 0 = slot never written;
+        uint32_t checksum;          // FNV-1a of info;
+        uint32_t reserved;
+        UsbMonitorInfo info;
+    };
+
+    struct IndexEntry {
+        int64_t  kernel_time;
+        uint64_t sequence;
+    };
+
+    struct SegmentHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t record_size;
+        uint32_t records;           // JOURNAL_SEGMENT_RECORDS;
+        uint64_t segment;           // Index of the segment, also in the file name;
+        uint64_t first_sequence;    // Sequence of the first slot;
+        uint8_t  reserved[4096 - 32];
+        IndexEntry index[JOURNAL_SEGMENT_RECORDS / JOURNAL_INDEX_STRIDE];
+    };
+
+    EventJournal(){
+        mSegment = NULL;
+        mSegmentIndex = 0;
+        mSlot = 0;
+        mNextSequence = 1;
+    }
+
+    ~EventJournal(){
+        Unmap();
+    }
+
+    // Open or create the journal in dir and find where the last run stopped;
+    int Open(const char* dir){
+        mDir = dir;
+        if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+            LOGE("journal mkdir %s failed, errno = %d \n", dir, errno);
+            return errno;
+        }
+
+        std::vector<uint64_t> segments = ListSegments();
+        if (segments.empty()){
+            return MapSegment(0, 1);
+        }
+
+        int ret = MapSegment(segments.back(), 0);
+        if (ret == EINVAL){
+            // Written with another record layout, keep it and start after it,
+            // numbering on past every sequence any segment may hold;
+            uint64_t next = 1;
+            for (size_t i = 0; i < segments.size(); i++){
+                next = std::max(next, EndSequence(segments[i]));
+            }
+            LOGW("journal %s: segment %llu has another layout, start a new one at sequence %llu \n", dir,
+                 (unsigned long long)segments.back(), (unsigned long long)next);
+            mNextSequence = next;
+            return MapSegment(segments.back() + 1, next);
+        }
+        if (ret != 0){
+            return ret;
+        }
+
+        // Recover the tail: the first slot that is not a committed record;
+        uint64_t sequence = mSegment->first_sequence;
+        for (mSlot = 0; mSlot < JOURNAL_SEGMENT_RECORDS; mSlot++, sequence++){
+            if (!IsCommitted(mRecords[mSlot], sequence)){
+                break;
+            }
+        }
+        mNextSequence = sequence;
+        LOGI("journal %s: segment %llu, next sequence %llu \n", dir,
+             (unsigned long long)mSegmentIndex, (unsigned long long)mNextSequence);
+
+        if (mSlot == JOURNAL_SEGMENT_RECORDS){
+            return Rotate();
+        }
+        return 0;
+    }
+
+    // Hot path, no syscall except when the segment is full;
+    int Append(const UsbMonitorInfo* info, size_t count){
+        for (size_t i = 0; i < count; i++){
+            if (mSlot == JOURNAL_SEGMENT_RECORDS){
+                int ret = Rotate();
+                if (ret != 0){
+                    return ret;
+                }
+            }
+
+            Record* record = &mRecords[mSlot];
+            record->info = info[i];
+            record->reserved = 0;
+            record->checksum = Checksum(info[i]);
+            if (mSlot % JOURNAL_INDEX_STRIDE == 0){
+                IndexEntry* entry = &mSegment->index[mSlot / JOURNAL_INDEX_STRIDE];
+                entry->kernel_time = info[i].info.kernel_time;
+                entry->sequence = mNextSequence;
+            }
+            // Commit;
+            __atomic_store_n(&record->sequence, mNextSequence, __ATOMIC_RELEASE);
+
+            mNextSequence++;
+            mSlot++;
+        }
+        return 0;
+    }
+
+    // Schedule write back of the current segment, from a timer;
+    void Flush(){
+        if (mSegment != NULL){
+            msync(mSegment, SegmentBytes(), MS_ASYNC);
+        }
+    }
+
+    uint64_t GetNextSequence() { return mNextSequence; };
+
+    // Call back with every committed record from sequence on, oldest first;
+    // Returns the number of records replayed;
+    uint64_t Replay(uint64_t sequence, std::function<void(uint64_t sequence, const UsbMonitorInfo& info)> callback){
+        uint64_t replayed = 0;
+        std::vector<uint64_t> segments = ListSegments();
+
+        for (size_t i = 0; i < segments.size(); i++){
+            const SegmentHeader* segment = segments[i] == mSegmentIndex ? mSegment : MapReadOnly(segments[i]);
+            if (segment == NULL){
+                continue;
+            }
+
+            const Record* records = RecordsOf(segment);
+            uint64_t first = segment->first_sequence;
+            if (first + JOURNAL_SEGMENT_RECORDS > sequence){
+                uint32_t slot = sequence > first ? (uint32_t)(sequence - first) : 0;
+                for (; slot < JOURNAL_SEGMENT_RECORDS; slot++){
+                    if (!IsCommitted(records[slot], first + slot)){
+                        break;
+                    }
+                    callback(first + slot, records[slot].info);
+                    replayed++;
+                }
+            }
+
+            if (segment != mSegment){
+                munmap((void*)segment, SegmentBytes());
+            }
+        }
+        return replayed;
+    }
+
+    // Replay the newest count records, e.g. to rebuild the in-memory ring;
+    uint64_t ReplayTail(uint64_t count, std::function<void(uint64_t sequence, const UsbMonitorInfo& info)> callback){
+        uint64_t sequence = mNextSequence > count ? mNextSequence - count : 1;
+        return Replay(sequence, callback);
+    }
+
+    // Sequence of the first record at or after kernel_time, from the sparse
+    // indexes; GetNextSequence() if there is none;
+    uint64_t Seek(int64_t kernel_time){
+        uint64_t found = mNextSequence;
+        std::vector<uint64_t> segments = ListSegments();
+
+        for (size_t i = segments.size(); i-- > 0;){
+            const SegmentHeader* segment = segments[i] == mSegmentIndex ? mSegment : MapReadOnly(segments[i]);
+            if (segment == NULL){
+                continue;
+            }
+
+            const Record* records = RecordsOf(segment);
+            uint64_t first = segment->first_sequence;
+            bool before = IsCommitted(records[0], first) && records[0].info.info.kernel_time < kernel_time;
+            if (before){
+                // Last index entry before kernel_time, then scan one stride;
+                uint32_t lo = 0, hi = JOURNAL_SEGMENT_RECORDS / JOURNAL_INDEX_STRIDE;
+                while (hi - lo > 1){
+                    uint32_t mid = (lo + hi) / 2;
+                    const IndexEntry& entry = segment->index[mid];
+                    if (entry.sequence == first + mid * JOURNAL_INDEX_STRIDE && entry.kernel_time < kernel_time){
+                        lo = mid;
+                    }else{
+                        hi = mid;
+                    }
+                }
+                for (uint32_t slot = lo * JOURNAL_INDEX_STRIDE; slot < JOURNAL_SEGMENT_RECORDS; slot++){
+                    if (!IsCommitted(records[slot], first + slot) || records[slot].info.info.kernel_time >= kernel_time){
+                        found = first + slot;
+                        break;
+                    }
+                }
+            }else if (IsCommitted(records[0], first)){
+                found = first;
+            }
+
+            if (segment != mSegment){
+                munmap((void*)segment, SegmentBytes());
+            }
+            if (before){
+                break;
+            }
+        }
+        return found;
+    }
+
+private:
+    static size_t SegmentBytes(){
+        return sizeof(SegmentHeader) + (size_t)JOURNAL_SEGMENT_RECORDS * sizeof(Record);
+    }
+
+    static const Record* RecordsOf(const SegmentHeader* segment){
+        return (const Record*)(segment + 1);
+    }
+
+    static uint32_t Checksum(const UsbMonitorInfo& info){
+        const uint8_t* bytes = (const uint8_t*)&info;
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < sizeof(info); i++){
+            hash = (hash ^ bytes[i]) * 16777619u;
+        }
+        return hash;
+    }
+
+    static bool IsCommitted(const Record& record, uint64_t sequence){
+        return __atomic_load_n(&record.sequence, __ATOMIC_ACQUIRE) == sequence &&
+               record.checksum == Checksum(record.info);
+    }
+
+    std::string SegmentPath(uint64_t segment){
+        char name[64];
+        snprintf(name, sizeof(name), "/journal-%08llu.seg", (unsigned long long)segment);
+        return mDir + name;
+    }
+
+    std::vector<uint64_t> ListSegments(){
+        std::vector<uint64_t> segments;
+        DIR* dir = opendir(mDir.c_str());
+        if (dir == NULL){
+            return segments;
+        }
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL){
+            unsigned long long segment;
+            if (sscanf(entry->d_name, "journal-%llu.seg", &segment) == 1){
+                segments.push_back(segment);
+            }
+        }
+        closedir(dir);
+        std::sort(segments.begin(), segments.end());
+        return segments;
+    }
+
+    // Map segment for appending, creating it starting at first_sequence if
+    // first_sequence is not 0;
+    int MapSegment(uint64_t segment, uint64_t first_sequence){
+        std::string path = SegmentPath(segment);
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            LOGE("journal open %s failed, errno = %d \n", path.c_str(), errno);
+            return errno;
+        }
+
+        // Allocate the blocks up front so stores into the mapping never hit ENOSPC;
+        int ret = posix_fallocate(fd, 0, SegmentBytes());
+        if (ret != 0) {
+            LOGE("journal fallocate %s failed, errno = %d \n", path.c_str(), ret);
+            close(fd);
+            return ret;
+        }
+
+        void* addr = mmap(NULL, SegmentBytes(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED) {
+            LOGE("journal mmap %s failed, errno = %d \n", path.c_str(), errno);
+            return errno;
+        }
+
+        SegmentHeader* header = (SegmentHeader*)addr;
+        if (first_sequence != 0){
+            header->magic = JOURNAL_MAGIC;
+            header->version = JOURNAL_VERSION;
+            header->record_size = sizeof(Record);
+            header->records = JOURNAL_SEGMENT_RECORDS;
+            header->segment = segment;
+            header->first_sequence = first_sequence;
+        }else if (header->magic != JOURNAL_MAGIC || header->version != JOURNAL_VERSION ||
+                  header->record_size != sizeof(Record)){
+            LOGE("journal %s has an unknown layout \n", path.c_str());
+            munmap(addr, SegmentBytes());
+            return EINVAL;
+        }
+
+        mSegment = header;
+        mRecords = (Record*)(header + 1);
+        mSegmentIndex = segment;
+        mSlot = 0;
+        return 0;
+    }
+
+    // Sequence after the last slot of segment, from the leading header
+    // fields every layout shares; 1 if it has none;
+    uint64_t EndSequence(uint64_t segment){
+        SegmentHeader header;
+        size_t leading = offsetof(SegmentHeader, reserved);
+        std::string path = SegmentPath(segment);
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return 1;
+        }
+        ssize_t leng = pread(fd, &header, leading, 0);
+        close(fd);
+        if (leng != (ssize_t)leading || header.magic != JOURNAL_MAGIC){
+            return 1;
+        }
+        return header.first_sequence + header.records;
+    }
+
+    const SegmentHeader* MapReadOnly(uint64_t segment){
+        std::string path = SegmentPath(segment);
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return NULL;
+        }
+        void* addr = mmap(NULL, SegmentBytes(), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED) {
+            return NULL;
+        }
+
+        const SegmentHeader* header = (const SegmentHeader*)addr;
+        if (header->magic != JOURNAL_MAGIC || header->version != JOURNAL_VERSION ||
+            header->record_size != sizeof(Record)){
+            munmap(addr, SegmentBytes());
+            return NULL;
+        }
+        return header;
+    }
+
+    void Unmap(){
+        if (mSegment != NULL){
+            msync(mSegment, SegmentBytes(), MS_ASYNC);
+            munmap(mSegment, SegmentBytes());
+            mSegment = NULL;
+        }
+    }
+
+    // Start the next segment and drop the oldest beyond JOURNAL_MAX_SEGMENTS;
+    int Rotate(){
+        uint64_t next = mSegmentIndex + 1;
+        Unmap();
+
+        int ret = MapSegment(next, mNextSequence);
+        if (ret != 0){
+            return ret;
+        }
+
+        std::vector<uint64_t> segments = ListSegments();
+        for (size_t i = 0; i + JOURNAL_MAX_SEGMENTS < segments.size(); i++){
+            unlink(SegmentPath(segments[i]).c_str());
+        }
+        return 0;
+    }
+
+    std::string mDir;
+    SegmentHeader* mSegment;
+    Record* mRecords;
+    uint64_t mSegmentIndex;
+    uint32_t mSlot;             // Next slot to write in mSegment;
+    uint64_t mNextSequence;
+};
+
+#endif
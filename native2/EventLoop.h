@@ -0,0 +1,229 @@
+#ifndef __EVENT_LOOP_H_
+#define __EVENT_LOOP_H_
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <vector>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include "Log.h"
+
+// Single threaded epoll reactor.
+//
+// Every source is a file descriptor: the /proc node, timers (timerfd), signals
+// (signalfd) and cross-thread wakeups (eventfd). Handlers run on the thread
+// calling Run(). Sources added with EPOLLET must be drained by their handler
+// until read() reports EAGAIN, the loop will not report them again before
+// new data arrives.
+class EventLoop {
+public:
+    typedef std::function<void(uint32_t events)> Handler;
+
+    // maxEvents: most ready sources returned by one epoll_wait;
+    explicit EventLoop(int maxEvents = 16) : mEvents(maxEvents){
+        mEpollfd = -1;
+        mWakeupfd = -1;
+        mRunning = false;
+    }
+
+    ~EventLoop(){
+        for (size_t i = 0; i < mOwnedFds.size(); i++){
+            close(mOwnedFds[i]);
+        }
+        if (mEpollfd != -1){
+            close(mEpollfd);
+        }
+    }
+
+    int InitSetup(){
+        mEpollfd = epoll_create1(EPOLL_CLOEXEC);
+        if (mEpollfd == -1) {
+            LOGE("epoll_create1 failed, errno = %d \n", errno);
+            return errno;
+        }
+
+        // Wakeup() from any thread makes the loop run the wakeup handler;
+        mWakeupfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (mWakeupfd == -1) {
+            LOGE("eventfd failed, errno = %d \n", errno);
+            return errno;
+        }
+        mOwnedFds.push_back(mWakeupfd);
+        return AddFd(mWakeupfd, EPOLLIN, [this](uint32_t){
+            uint64_t value;
+            while (read(mWakeupfd, &value, sizeof(value)) > 0){
+            }
+            if (mWakeupHandler){
+                mWakeupHandler();
+            }
+        });
+    }
+
+    // Watch fd, the caller keeps ownership;
+    int AddFd(int fd, uint32_t events, Handler handler){
+        struct epoll_event epev;
+        memset(&epev, 0, sizeof(epev));
+        epev.data.fd = fd;
+        epev.events = events;
+        if (epoll_ctl(mEpollfd, EPOLL_CTL_ADD, fd, &epev) < 0) {
+            LOGE("epoll_ctl failed, errno = %d \n", errno);
+            return errno;
+        }
+        // The fd number may have been closed and reused within one batch;
+        mRemoved.erase(std::remove(mRemoved.begin(), mRemoved.end(), fd), mRemoved.end());
+        mHandlers[fd] = handler;
+        return 0;
+    }
+
+    // Change the events watched on fd, e.g. to add EPOLLOUT while a write is pending;
+    int ModifyFd(int fd, uint32_t events){
+        struct epoll_event epev;
+        memset(&epev, 0, sizeof(epev));
+        epev.data.fd = fd;
+        epev.events = events;
+        if (epoll_ctl(mEpollfd, EPOLL_CTL_MOD, fd, &epev) < 0) {
+            LOGE("epoll_ctl failed, errno = %d \n", errno);
+            return errno;
+        }
+        return 0;
+    }
+
+    // Safe from the fd's own handler, which is only destroyed once the
+    // current batch of events is dispatched;
+    void RemoveFd(int fd){
+        epoll_ctl(mEpollfd, EPOLL_CTL_DEL, fd, NULL);
+        mRemoved.push_back(fd);
+    }
+
+    // Run handler every interval_ms, with the number of expirations since the last call;
+    int AddTimer(int interval_ms, std::function<void(uint64_t expirations)> handler){
+        int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (fd == -1) {
+            LOGE("timerfd_create failed, errno = %d \n", errno);
+            return errno;
+        }
+        mOwnedFds.push_back(fd);
+
+        struct itimerspec spec;
+        spec.it_interval.tv_sec = interval_ms / 1000;
+        spec.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+        spec.it_value = spec.it_interval;
+        if (timerfd_settime(fd, 0, &spec, NULL) != 0) {
+            LOGE("timerfd_settime failed, errno = %d \n", errno);
+            return errno;
+        }
+
+        return AddFd(fd, EPOLLIN, [fd, handler](uint32_t){
+            uint64_t expirations;
+            if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations)){
+                handler(expirations);
+            }
+        });
+    }
+
+    // Deliver signals through the loop. They must already be blocked in every
+    // thread, see BlockSignals;
+    int AddSignals(const std::vector<int>& signals, std::function<void(int signo)> handler){
+        sigset_t mask;
+        sigemptyset(&mask);
+        for (size_t i = 0; i < signals.size(); i++){
+            sigaddset(&mask, signals[i]);
+        }
+
+        int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (fd == -1) {
+            LOGE("signalfd failed, errno = %d \n", errno);
+            return errno;
+        }
+        mOwnedFds.push_back(fd);
+
+        return AddFd(fd, EPOLLIN, [fd, handler](uint32_t){
+            struct signalfd_siginfo info;
+            while (read(fd, &info, sizeof(info)) == sizeof(info)){
+                handler(info.ssi_signo);
+            }
+        });
+    }
+
+    // Block signals for the calling thread and every thread it creates later;
+    static int BlockSignals(const std::vector<int>& signals){
+        sigset_t mask;
+        sigemptyset(&mask);
+        for (size_t i = 0; i < signals.size(); i++){
+            sigaddset(&mask, signals[i]);
+        }
+        return pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    }
+
+    void SetWakeupHandler(std::function<void()> handler){
+        mWakeupHandler = handler;
+    }
+
+    // Thread safe;
+    void Wakeup(){
+        uint64_t one = 1;
+        if (write(mWakeupfd, &one, sizeof(one)) < 0 && errno != EAGAIN){
+            LOGE("eventfd write failed, errno = %d \n", errno);
+        }
+    }
+
+    // Dispatch until Stop(), returns 0 or the epoll_wait errno;
+    int Run(){
+        struct epoll_event* events = &mEvents[0];
+
+        mRunning = true;
+        while (mRunning){
+            int ret = epoll_wait(mEpollfd, events, (int)mEvents.size(), -1);
+            if (ret == -1) {
+                if (errno == EINTR){
+                    continue;
+                }
+                LOGE("epoll_wait failed, errno = %d \n", errno);
+                return errno;
+            }
+
+            for (int i = 0; i < ret && mRunning; i++){
+                int fd = events[i].data.fd;
+                if (!mRemoved.empty() && std::find(mRemoved.begin(), mRemoved.end(), fd) != mRemoved.end()){
+                    continue;
+                }
+                std::map<int, Handler>::iterator it = mHandlers.find(fd);
+                if (it != mHandlers.end()){
+                    it->second(events[i].events);
+                }
+            }
+
+            for (size_t i = 0; i < mRemoved.size(); i++){
+                mHandlers.erase(mRemoved[i]);
+            }
+            mRemoved.clear();
+        }
+        return 0;
+    }
+
+    // From a handler, or from another thread followed by Wakeup();
+    void Stop(){
+        mRunning = false;
+    }
+
+private:
+    int mEpollfd;
+    int mWakeupfd;
+    volatile bool mRunning;
+    std::map<int, Handler> mHandlers;
+    std::vector<int> mOwnedFds;
+    std::vector<int> mRemoved;          // Handlers to destroy after the current batch;
+    std::vector<struct epoll_event> mEvents;
+    std::function<void()> mWakeupHandler;
+};
+
+#endif
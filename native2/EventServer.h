@@ -0,0 +1,379 @@
+#ifndef __EVENT_SERVER_H_
+#define __EVENT_SERVER_H_
+
+#include <map>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "EventLoop.h"
+#include "Log.h"
+#include "UsbInfo.h"
+
+// Serves the event stream to local clients over a Unix domain socket.
+//
+// A client connects, sends an EventServerHello with the sequence it wants to
+// resume from (0 for new events only) and gets the hello back with the
+// sequence it will actually start at, followed by EventServerRecords.
+//
+// Published records are kept once in a history ring. A client is only a
+// cursor into it, so fan-out costs no copy; Flush sends each client its
+// unsent run with one sendmsg of up to three iovecs. Everything runs on the
+// event loop thread and no socket ever blocks it: a client whose socket is
+// full is parked on EPOLLOUT, and one that falls a whole history behind is
+// disconnected, it may reconnect and resume from its last sequence.
+struct EventServerHello {
+    uint32_t magic;             // EVENT_SERVER_MAGIC;
+    uint32_t version;           // EVENT_SERVER_VERSION;
+    uint64_t resume_sequence;   // Client: first wanted, 0 = from now; server: first sent;
+};
+
+struct EventServerRecord {
+    uint64_t sequence;
+    uint8_t  reserved[8];
+    struct usb_message_t info;
+};
+
+#define EVENT_SERVER_MAGIC      0x53425355      // "USBS"
+#define EVENT_SERVER_VERSION    2       // Follows the layout of usb_message_t;
+
+class EventServer {
+public:
+    EventServer(const char* path, size_t history = SERVER_HISTORY, size_t maxClients = SERVER_MAX_CLIENTS){
+        mPath = path;
+        mMaxClients = maxClients;
+        size_t size = 1;
+        while (size < history){
+            size <<= 1;
+        }
+        mHistory.resize(size);
+        mMask = size - 1;
+        mLoop = NULL;
+        mListenFd = -1;
+        mFirst = mNext = 1;
+    }
+
+    ~EventServer(){
+        Stop();
+    }
+
+    // Listen on the loop; records published later get sequences from first_sequence on;
+    int Start(EventLoop* loop, uint64_t first_sequence){
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (mPath.size() >= sizeof(addr.sun_path)){
+            LOGE("socket path %s too long \n", mPath.c_str());
+            return ENAMETOOLONG;
+        }
+        strcpy(addr.sun_path, mPath.c_str());
+
+        mListenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (mListenFd == -1) {
+            LOGE("socket failed, errno = %d \n", errno);
+            return errno;
+        }
+        // A stale socket from a previous run;
+        unlink(mPath.c_str());
+        if (bind(mListenFd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(mListenFd, SOMAXCONN) != 0) {
+            LOGE("bind/listen %s failed, errno = %d \n", mPath.c_str(), errno);
+            return errno;
+        }
+
+        mLoop = loop;
+        mFirst = mNext = first_sequence;
+        LOGI("serving events on %s from sequence %llu \n", mPath.c_str(), (unsigned long long)mNext);
+        return mLoop->AddFd(mListenFd, EPOLLIN, [this](uint32_t){
+            Accept();
+        });
+    }
+
+    // Disconnect everybody and stop listening;
+    void Stop(){
+        while (!mClients.empty()){
+            Close(mClients.begin()->first);
+        }
+        if (mListenFd != -1){
+            if (mLoop != NULL){
+                mLoop->RemoveFd(mListenFd);
+            }
+            close(mListenFd);
+            unlink(mPath.c_str());
+            mListenFd = -1;
+        }
+        mLoop = NULL;
+    }
+
+    // Add records to the history, sent by the next Flush;
+    void Publish(const UsbMonitorInfo* deviceinfo, size_t count){
+        for (size_t i = 0; i < count; i++){
+            EventServerRecord& record = mHistory[mNext & mMask];
+            record.sequence = mNext;
+            memset(record.reserved, 0, sizeof(record.reserved));
+            record.info = deviceinfo[i].info;
+            mNext++;
+        }
+    }
+
+    // Send every client what it has not got yet, without blocking;
+    void Flush(){
+        std::vector<int> failed;
+        for (std::map<int, Client>::iterator it = mClients.begin(); it != mClients.end(); ++it){
+            Client& client = it->second;
+            if (client.blocked){
+                // Lapped while its socket stayed full;
+                if (mNext - client.cursor > mHistory.size()){
+                    LOGW("client fd %d stopped reading, disconnect \n", client.fd);
+                    failed.push_back(it->first);
+                }
+            }else if (HasPending(client) && !Send(client)){
+                failed.push_back(it->first);
+            }
+        }
+        for (size_t i = 0; i < failed.size(); i++){
+            Close(failed[i]);
+        }
+    }
+
+    size_t GetClientCount() { return mClients.size(); };
+
+private:
+    struct Client {
+        int fd;
+        bool ready;                 // Hello received;
+        bool blocked;               // Socket full, waiting for EPOLLOUT;
+        bool watching_out;          // EPOLLOUT is in the epoll set;
+        bool read_closed;           // Peer shut down its sending side;
+        uint64_t cursor;            // Sequence of the next record to send;
+        size_t offset;              // Bytes of that record already sent;
+        EventServerHello hello;
+        size_t hello_leng;          // Received before ready, sent after;
+    };
+
+    // A client that shut down its sending side may still receive;
+    uint32_t GetMask(const Client& client){
+        return (client.read_closed ? 0u : (uint32_t)EPOLLIN) | (client.watching_out ? (uint32_t)EPOLLOUT : 0u);
+    }
+
+    bool HasPending(const Client& client){
+        return client.ready && (client.hello_leng < sizeof(client.hello) || client.cursor != mNext);
+    }
+
+    uint64_t GetOldest(){
+        uint64_t held = mNext - mFirst;
+        return held > mHistory.size() ? mNext - mHistory.size() : mFirst;
+    }
+
+    void Accept(){
+        while (1){
+            int fd = accept4(mListenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd == -1){
+                if (errno == EINTR){
+                    continue;
+                }
+                if (errno != EAGAIN){
+                    LOGE("accept failed, errno = %d \n", errno);
+                }
+                return;
+            }
+            if (mClients.size() >= mMaxClients){
+                LOGW("too many clients, refuse fd %d \n", fd);
+                close(fd);
+                continue;
+            }
+
+            Client& client = mClients[fd];
+            memset(&client, 0, sizeof(client));
+            client.fd = fd;
+            if (mLoop->AddFd(fd, EPOLLIN, [this, fd](uint32_t events){
+                    OnClient(fd, events);
+                }) != 0){
+                mClients.erase(fd);
+                close(fd);
+            }
+        }
+    }
+
+    void OnClient(int fd, uint32_t events){
+        std::map<int, Client>::iterator it = mClients.find(fd);
+        if (it == mClients.end()){
+            return;
+        }
+        Client& client = it->second;
+
+        if (events & (EPOLLERR | EPOLLHUP)){
+            Close(fd);
+            return;
+        }
+
+        if ((events & EPOLLIN) && !client.read_closed){
+            char buf[256];
+            ssize_t leng;
+            while (1){
+                if (!client.ready){
+                    leng = recv(fd, (char*)&client.hello + client.hello_leng, sizeof(client.hello) - client.hello_leng, 0);
+                }else{
+                    // Nothing is expected after the hello;
+                    leng = recv(fd, buf, sizeof(buf), 0);
+                }
+                if (leng == 0 && client.ready){
+                    // Half closed after the hello, keep sending;
+                    client.read_closed = true;
+                    if (mLoop->ModifyFd(fd, GetMask(client)) != 0){
+                        Close(fd);
+                        return;
+                    }
+                    break;
+                }
+                if (leng == 0 || (leng < 0 && errno != EAGAIN && errno != EINTR)){
+                    Close(fd);
+                    return;
+                }
+                if (leng < 0){
+                    if (errno == EINTR){
+                        continue;
+                    }
+                    break;
+                }
+                if (!client.ready){
+                    client.hello_leng += leng;
+                    if (client.hello_leng == sizeof(client.hello) && !Welcome(client)){
+                        Close(fd);
+                        return;
+                    }
+                }
+            }
+        }
+
+        if ((events & EPOLLOUT) || (HasPending(client) && !client.blocked)){
+            client.blocked = false;
+            if (!Send(client)){
+                Close(fd);
+            }
+        }
+    }
+
+    // Hello received, pick the starting sequence and queue the reply;
+    bool Welcome(Client& client){
+        if (client.hello.magic != EVENT_SERVER_MAGIC || client.hello.version != EVENT_SERVER_VERSION){
+            LOGW("client speaks %x version %u, refused \n", client.hello.magic, client.hello.version);
+            return false;
+        }
+
+        uint64_t resume = client.hello.resume_sequence;
+        uint64_t oldest = GetOldest();
+        if (resume == 0 || resume > mNext){
+            resume = mNext;
+        }else if (resume < oldest){
+            resume = oldest;
+        }
+
+        client.cursor = resume;
+        client.offset = 0;
+        client.hello.resume_sequence = resume;
+        client.hello_leng = 0;      // Now counts bytes of the reply sent;
+        client.ready = true;
+        return true;
+    }
+
+    // Returns false if the client has to go;
+    bool Send(Client& client){
+        int fd = client.fd;
+
+        while (HasPending(client)){
+            if (mNext - client.cursor > mHistory.size()){
+                LOGW("client fd %d fell %llu records behind, disconnect \n", fd,
+                     (unsigned long long)(mNext - client.cursor));
+                return false;
+            }
+
+            struct iovec iov[3];
+            int count = 0;
+            if (client.hello_leng < sizeof(client.hello)){
+                iov[count].iov_base = (char*)&client.hello + client.hello_leng;
+                iov[count].iov_len = sizeof(client.hello) - client.hello_leng;
+                count++;
+            }
+
+            // At most two runs of the history, before and after the wrap;
+            uint64_t cursor = client.cursor;
+            size_t offset = client.offset;
+            while (cursor != mNext && count < 3){
+                size_t index = cursor & mMask;
+                size_t run = mHistory.size() - index;
+                if (run > mNext - cursor){
+                    run = mNext - cursor;
+                }
+                iov[count].iov_base = (char*)&mHistory[index] + offset;
+                iov[count].iov_len = run * sizeof(EventServerRecord) - offset;
+                count++;
+                cursor += run;
+                offset = 0;
+            }
+
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+            ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (sent < 0){
+                if (errno == EINTR){
+                    continue;
+                }
+                if (errno == EAGAIN){
+                    // Backpressure, resume on EPOLLOUT;
+                    client.blocked = true;
+                    if (client.watching_out){
+                        return true;
+                    }
+                    client.watching_out = true;
+                    return mLoop->ModifyFd(fd, GetMask(client)) == 0;
+                }
+                return false;
+            }
+
+            size_t left = (size_t)sent;
+            if (client.hello_leng < sizeof(client.hello)){
+                size_t hello = sizeof(client.hello) - client.hello_leng;
+                hello = left < hello ? left : hello;
+                client.hello_leng += hello;
+                left -= hello;
+            }
+            left += client.offset;
+            client.cursor += left / sizeof(EventServerRecord);
+            client.offset = left % sizeof(EventServerRecord);
+        }
+
+        // Caught up, stop watching EPOLLOUT;
+        if (client.watching_out){
+            client.watching_out = false;
+            return mLoop->ModifyFd(fd, GetMask(client)) == 0;
+        }
+        return true;
+    }
+
+    void Close(int fd){
+        mLoop->RemoveFd(fd);
+        close(fd);
+        mClients.erase(fd);
+    }
+
+    std::string mPath;
+    size_t mMaxClients;
+    std::vector<EventServerRecord> mHistory;   // Power of two, by sequence;
+    uint64_t mMask;
+    uint64_t mFirst;            // Sequence of the first record published;
+    uint64_t mNext;             // Sequence of the next record published;
+    EventLoop* mLoop;
+    int mListenFd;
+    std::map<int, Client> mClients;
+};
+
+#endif
@@ -0,0 +1,198 @@
+#ifndef __IO_URING_H_
+#define __IO_URING_H_
+
+// Minimal io_uring wrapper over the raw syscalls, only what the monitor needs:
+// fixed buffer reads submitted in batches and completions reaped in batches.
+// Built only when the kernel headers provide <linux/io_uring.h> and
+// USB_MONITOR_NO_IO_URING is not defined; UsbMonitorDevice falls back to the
+// epoll path when it is not built or io_uring_setup fails at run time.
+#if !defined(USB_MONITOR_NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define USB_MONITOR_HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef USB_MONITOR_HAVE_IO_URING
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+class IoUring {
+public:
+    IoUring(){
+        mRingFd = -1;
+        mSqRing = mCqRing = NULL;
+        mSqes = NULL;
+        mSqRingBytes = mCqRingBytes = mSqesBytes = 0;
+        mToSubmit = 0;
+    }
+
+    ~IoUring(){
+        if (mSqes != NULL){
+            munmap(mSqes, mSqesBytes);
+        }
+        if (mCqRing != NULL && mCqRing != mSqRing){
+            munmap(mCqRing, mCqRingBytes);
+        }
+        if (mSqRing != NULL){
+            munmap(mSqRing, mSqRingBytes);
+        }
+        if (mRingFd != -1){
+            close(mRingFd);
+        }
+    }
+
+    // Returns 0, or the errno of io_uring_setup (ENOSYS, EPERM, ...) so the
+    // caller can fall back;
+    int InitSetup(unsigned entries){
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+
+        mRingFd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if (mRingFd < 0) {
+            return errno;
+        }
+
+        mSqRingBytes = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        mCqRingBytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP){
+            if (mCqRingBytes > mSqRingBytes){
+                mSqRingBytes = mCqRingBytes;
+            }
+            mCqRingBytes = mSqRingBytes;
+        }
+
+        mSqRing = mmap(NULL, mSqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       mRingFd, IORING_OFF_SQ_RING);
+        if (mSqRing == MAP_FAILED) {
+            mSqRing = NULL;
+            return errno;
+        }
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP){
+            mCqRing = mSqRing;
+        }else{
+            mCqRing = mmap(NULL, mCqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           mRingFd, IORING_OFF_CQ_RING);
+            if (mCqRing == MAP_FAILED) {
+                mCqRing = NULL;
+                return errno;
+            }
+        }
+
+        mSqesBytes = params.sq_entries * sizeof(struct io_uring_sqe);
+        mSqes = (struct io_uring_sqe*)mmap(NULL, mSqesBytes, PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_SQES);
+        if (mSqes == MAP_FAILED) {
+            mSqes = NULL;
+            return errno;
+        }
+
+        char* sq = (char*)mSqRing;
+        mSqHead = (uint32_t*)(sq + params.sq_off.head);
+        mSqTail = (uint32_t*)(sq + params.sq_off.tail);
+        mSqMask = *(uint32_t*)(sq + params.sq_off.ring_mask);
+        mSqEntries = params.sq_entries;
+        mSqArray = (uint32_t*)(sq + params.sq_off.array);
+
+        char* cq = (char*)mCqRing;
+        mCqHead = (uint32_t*)(cq + params.cq_off.head);
+        mCqTail = (uint32_t*)(cq + params.cq_off.tail);
+        mCqMask = *(uint32_t*)(cq + params.cq_off.ring_mask);
+        mCqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+        return 0;
+    }
+
+    // The ring fd becomes readable when completions are waiting;
+    int getFd() { return mRingFd; };
+
+    // Pin buffers once so fixed reads skip the per-request page lookup;
+    int RegisterBuffers(const struct iovec* iov, unsigned count){
+        if (syscall(__NR_io_uring_register, mRingFd, IORING_REGISTER_BUFFERS, iov, count) < 0) {
+            return errno;
+        }
+        return 0;
+    }
+
+    // Queue a read into registered buffer bufIndex, sent by the next Submit;
+    bool PrepReadFixed(int fd, void* buf, unsigned len, unsigned bufIndex, uint64_t userData){
+        uint32_t tail = *mSqTail;
+        if (tail - __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE) >= mSqEntries){
+            return false;
+        }
+
+        uint32_t index = tail & mSqMask;
+        struct io_uring_sqe* sqe = &mSqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = len;
+        sqe->buf_index = bufIndex;
+        sqe->user_data = userData;
+
+        mSqArray[index] = index;
+        __atomic_store_n(mSqTail, tail + 1, __ATOMIC_RELEASE);
+        mToSubmit++;
+        return true;
+    }
+
+    // Submit everything queued, optionally waiting for waitNr completions;
+    int Submit(unsigned waitNr){
+        unsigned flags = waitNr > 0 ? IORING_ENTER_GETEVENTS : 0;
+        while (1){
+            int ret = (int)syscall(__NR_io_uring_enter, mRingFd, mToSubmit, waitNr, flags, NULL, 0);
+            if (ret >= 0){
+                mToSubmit -= ret;
+                return 0;
+            }
+            if (errno != EINTR){
+                return errno;
+            }
+        }
+    }
+
+    // Copy out up to max completions and release their slots;
+    unsigned ReapCompletions(struct io_uring_cqe* cqes, unsigned max){
+        uint32_t head = *mCqHead;
+        uint32_t tail = __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE);
+        unsigned count = 0;
+
+        while (head != tail && count < max){
+            cqes[count++] = mCqes[head & mCqMask];
+            head++;
+        }
+        __atomic_store_n(mCqHead, head, __ATOMIC_RELEASE);
+        return count;
+    }
+
+private:
+    int mRingFd;
+    void* mSqRing;
+    void* mCqRing;
+    struct io_uring_sqe* mSqes;
+    size_t mSqRingBytes, mCqRingBytes, mSqesBytes;
+    unsigned mToSubmit;
+
+    uint32_t* mSqHead;
+    uint32_t* mSqTail;
+    uint32_t mSqMask;
+    uint32_t mSqEntries;
+    uint32_t* mSqArray;
+
+    uint32_t* mCqHead;
+    uint32_t* mCqTail;
+    uint32_t mCqMask;
+    struct io_uring_cqe* mCqes;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef __LATENCY_HISTOGRAM_H_
+#define __LATENCY_HISTOGRAM_H_
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Log-linear histogram of latencies in ns.
+//
+// Values below 2^SUB_BITS get a bucket each; above that every power of two
+// is split into 2^SUB_BITS buckets, so a bucket is never wider than 1/16 of
+// its values and the whole range of uint64_t fits in under 1000 counters.
+// Record is a count leading zeros, a shift and one increment.
+//
+// Each histogram has a single writer, which updates its counters with
+// relaxed stores instead of atomic adds. Any thread may read percentiles
+// while it records; such a snapshot may lag by the values in flight.
+class LatencyHistogram {
+public:
+    static const int SUB_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+    LatencyHistogram(){
+        Reset();
+    }
+
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    // Writer thread only;
+    void Record(uint64_t value){
+        Increment(mCounts[Index(value)], 1);
+        Increment(mCount, 1);
+        if (value > mMax.load(std::memory_order_relaxed)){
+            mMax.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t GetCount() const { return mCount.load(std::memory_order_relaxed); }
+
+    uint64_t GetMax() const { return mMax.load(std::memory_order_relaxed); }
+
+    // Upper edge of the bucket holding the p-th fraction of the values, so
+    // the true percentile is never above it; 0 when empty;
+    uint64_t GetPercentile(double p) const {
+        uint64_t counts[BUCKETS];
+        uint64_t total = 0;
+        for (int i = 0; i < BUCKETS; i++){
+            counts[i] = mCounts[i].load(std::memory_order_relaxed);
+            total += counts[i];
+        }
+        if (total == 0){
+            return 0;
+        }
+
+        uint64_t rank = (uint64_t)(p * total);
+        rank = rank < 1 ? 1 : (rank > total ? total : rank);
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++){
+            seen += counts[i];
+            if (seen >= rank){
+                uint64_t upper = UpperEdge(i);
+                uint64_t max = GetMax();
+                return upper < max ? upper : max;
+            }
+        }
+        return GetMax();
+    }
+
+    // Not while the writer records;
+    void Reset(){
+        for (int i = 0; i < BUCKETS; i++){
+            mCounts[i].store(0, std::memory_order_relaxed);
+        }
+        mCount.store(0, std::memory_order_relaxed);
+        mMax.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    static void Increment(std::atomic<uint64_t>& counter, uint64_t n){
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    static int Index(uint64_t value){
+        if (value < SUB_BUCKETS){
+            return (int)value;
+        }
+        int exponent = 63 - __builtin_clzll(value);
+        int sub = (int)((value >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1));
+        return (exponent - SUB_BITS + 1) * SUB_BUCKETS + sub;
+    }
+
+    static uint64_t UpperEdge(int index){
+        if (index < SUB_BUCKETS){
+            return (uint64_t)index;
+        }
+        int exponent = index / SUB_BUCKETS + SUB_BITS - 1;
+        uint64_t sub = (uint64_t)(index % SUB_BUCKETS);
+        int shift = exponent - SUB_BITS;
+        // The last bucket ends at UINT64_MAX;
+        if (sub == SUB_BUCKETS - 1 && exponent == 63){
+            return UINT64_MAX;
+        }
+        return ((SUB_BUCKETS + sub + 1) << shift) - 1;
+    }
+
+    std::atomic<uint64_t> mCounts[BUCKETS];
+    std::atomic<uint64_t> mCount;
+    std::atomic<uint64_t> mMax;
+};
+
+#endif
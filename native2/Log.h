@@ -0,0 +1,172 @@
+#ifndef __LOG_H_
+#define __LOG_H_
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "SpscRingBuffer.h"
+
+#define LOG_LEVEL_DEBUG          0
+#define LOG_LEVEL_INFO           1
+#define LOG_LEVEL_WARN           2
+#define LOG_LEVEL_ERROR          3
+#define LOG_LEVEL_NONE           4
+
+// Levels below the threshold are compiled out, arguments included;
+// make build CXXFLAGS=-DUSB_MONITOR_LOG_LEVEL=0 turns the per-event logs on;
+#ifndef USB_MONITOR_LOG_LEVEL
+#define USB_MONITOR_LOG_LEVEL    LOG_LEVEL_INFO
+#endif
+
+#define LOG_AT(level, ...) \
+    do { if ((level) >= USB_MONITOR_LOG_LEVEL) AsyncLog::Write((level), __VA_ARGS__); } while (0)
+
+#define LOGD(...)   LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOGI(...)   LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOGW(...)   LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOGE(...)   LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+// Asynchronous logger.
+//
+// Each thread formats into its own SpscRingBuffer of fixed size lines, so a
+// log call costs one vsnprintf and a few stores, never a lock or a syscall.
+// A background writer drains every thread's buffer and writes them to stdout
+// in large batches. Lines that find their buffer full are dropped and counted.
+class AsyncLog {
+public:
+    static const size_t LINE_LENG = 248;
+    static const size_t LINES_PER_THREAD = 1024;
+    static const int IDLE_SLEEP_MS = 10;
+
+    struct Line {
+        int  level;
+        int  leng;
+        char text[LINE_LENG];
+    };
+
+    __attribute__((format(printf, 2, 3)))
+    static void Write(int level, const char* fmt, ...){
+        Line line;
+        va_list args;
+
+        va_start(args, fmt);
+        int leng = vsnprintf(line.text, sizeof(line.text), fmt, args);
+        va_end(args);
+        if (leng < 0){
+            return;
+        }
+        line.level = level;
+        line.leng = leng < (int)sizeof(line.text) ? leng : (int)sizeof(line.text) - 1;
+
+        if (!ThreadBuffer()->Append(line)){
+            Instance().mDropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Start the writer thread, lines logged before are kept until then;
+    static int Start(){
+        AsyncLog& log = Instance();
+        log.mRunning.store(true, std::memory_order_release);
+        return pthread_create(&log.mWriter, NULL, WriterThread, &log);
+    }
+
+    // Flush everything logged so far and stop the writer;
+    static void Stop(){
+        AsyncLog& log = Instance();
+        if (log.mRunning.exchange(false)){
+            pthread_join(log.mWriter, NULL);
+        }
+        log.Drain();
+    }
+
+    static uint64_t GetDropped(){
+        return Instance().mDropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    typedef SpscRingBuffer<Line> LineBuffer;
+
+    static AsyncLog& Instance(){
+        static AsyncLog log;
+        return log;
+    }
+
+    // Created on the first log call of each thread and kept until exit, so
+    // the writer never races with a thread going away;
+    static LineBuffer* ThreadBuffer(){
+        static thread_local LineBuffer* buffer = NULL;
+        if (buffer == NULL){
+            buffer = new LineBuffer(LINES_PER_THREAD);
+            AsyncLog& log = Instance();
+            std::lock_guard<std::mutex> lock(log.mBuffersMutex);
+            log.mBuffers.push_back(buffer);
+        }
+        return buffer;
+    }
+
+    static void* WriterThread(void* arg){
+        AsyncLog* log = (AsyncLog*)arg;
+        struct timespec idle = {0, IDLE_SLEEP_MS * 1000000L};
+
+        while (log->mRunning.load(std::memory_order_acquire)){
+            if (log->Drain() == 0){
+                nanosleep(&idle, NULL);
+            }
+        }
+        return NULL;
+    }
+
+    // Write out every buffered line, returns how many;
+    size_t Drain(){
+        static const char* tags = "DIWE";
+        Line lines[64];
+        size_t total = 0, count, i;
+        std::vector<LineBuffer*> buffers;
+        {
+            std::lock_guard<std::mutex> lock(mBuffersMutex);
+            buffers = mBuffers;
+        }
+
+        for (size_t b = 0; b < buffers.size(); b++){
+            while ((count = buffers[b]->PopFrontBatch(lines, 64)) > 0){
+                size_t used = 0;
+                for (i = 0; i < count; i++){
+                    mOut[used++] = tags[lines[i].level];
+                    mOut[used++] = ' ';
+                    memcpy(mOut + used, lines[i].text, lines[i].leng);
+                    used += lines[i].leng;
+                }
+                fwrite(mOut, 1, used, stdout);
+                total += count;
+            }
+        }
+
+        uint64_t dropped = mDropped.load(std::memory_order_relaxed);
+        if (dropped != mReportedDropped){
+            fprintf(stdout, "W %llu log lines dropped\n", (unsigned long long)(dropped - mReportedDropped));
+            mReportedDropped = dropped;
+        }
+        if (total > 0){
+            fflush(stdout);
+        }
+        return total;
+    }
+
+    AsyncLog() : mDropped(0), mRunning(false), mReportedDropped(0) {}
+
+    std::mutex mBuffersMutex;
+    std::vector<LineBuffer*> mBuffers;
+    std::atomic<uint64_t> mDropped;
+    std::atomic<bool> mRunning;
+    pthread_t mWriter;
+    uint64_t mReportedDropped;
+    char mOut[64 * (LINE_LENG + 2)];
+};
+
+#endif
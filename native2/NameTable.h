@@ -0,0 +1,155 @@
+#ifndef __NAME_TABLE_H_
+#define __NAME_TABLE_H_
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "UsbInfo.h"
+
+// Interned device names.
+//
+// Each distinct name gets a dense 32-bit id the first time it is seen, so
+// stored events carry an id instead of the name. Intern is called by the
+// thread appending events only. GetName may be called from any thread for
+// any id that thread got from an event: names are stored in chunks that
+// never move, and the count of ids is published with release.
+//
+// Names are whole usb_message_t.usb_name or serial fields, zero padded as
+// the driver writes them, so they are hashed and compared as four 64-bit
+// words.
+//
+// The table holds CHUNK_NAMES * MAX_CHUNKS names, about a million, with
+// chunks allocated as they fill. Past that Intern returns NONE and counts
+// the name as rejected.
+class NameTable {
+public:
+    static constexpr uint32_t NONE = 0xffffffff;
+    static const uint32_t CHUNK_NAMES = 256;
+    static const uint32_t MAX_CHUNKS = 4096;
+
+    NameTable(){
+        mSlots.assign(64, NONE);
+        mCount.store(0, std::memory_order_relaxed);
+        mRejected.store(0, std::memory_order_relaxed);
+        for (uint32_t i = 0; i < MAX_CHUNKS; i++){
+            mChunks[i] = NULL;
+        }
+    }
+
+    ~NameTable(){
+        for (uint32_t i = 0; i < MAX_CHUNKS; i++){
+            delete[] mChunks[i];
+        }
+    }
+
+    NameTable(const NameTable&) = delete;
+    NameTable& operator=(const NameTable&) = delete;
+
+    // Id of name, a new one if it was never seen; NONE once
+    // CHUNK_NAMES * MAX_CHUNKS names are taken;
+    uint32_t Intern(const char name[USB_MONITOR_NAME_LENG]){
+        uint32_t hash = Hash(name);
+        uint32_t count = mCount.load(std::memory_order_relaxed);
+        uint32_t id = Lookup(name, hash);
+        if (id != NONE){
+            return id;
+        }
+
+        if (count == CHUNK_NAMES * MAX_CHUNKS){
+            mRejected.store(mRejected.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return NONE;
+        }
+        if (mChunks[count / CHUNK_NAMES] == NULL){
+            mChunks[count / CHUNK_NAMES] = new Name[CHUNK_NAMES];
+        }
+        Name* slot = &mChunks[count / CHUNK_NAMES][count % CHUNK_NAMES];
+        memcpy(slot->name, name, USB_MONITOR_NAME_LENG);
+        slot->name[USB_MONITOR_NAME_LENG - 1] = '\0';
+        mHashes.push_back(hash);
+        mCount.store(count + 1, std::memory_order_release);
+
+        Insert(count);
+        // Keep the load factor at or below one half;
+        if ((size_t)(count + 1) * 2 > mSlots.size()){
+            Grow();
+        }
+        return count;
+    }
+
+    // Id of a C string name if it was interned, NONE otherwise; same thread as Intern;
+    uint32_t Find(const char* name) const {
+        char padded[USB_MONITOR_NAME_LENG];
+        memset(padded, 0, sizeof(padded));
+        strncpy(padded, name, sizeof(padded) - 1);
+        return Lookup(padded, Hash(padded));
+    }
+
+    const char* GetName(uint32_t id) const {
+        if (id >= mCount.load(std::memory_order_acquire)){
+            return "";
+        }
+        return mChunks[id / CHUNK_NAMES][id % CHUNK_NAMES].name;
+    }
+
+    uint32_t GetCount() const { return mCount.load(std::memory_order_acquire); }
+
+    // Intern calls that got NONE, from any thread;
+    uint64_t GetRejectedCount() const { return mRejected.load(std::memory_order_relaxed); }
+
+private:
+    struct Name {
+        char name[USB_MONITOR_NAME_LENG];
+    };
+
+    static_assert(USB_MONITOR_NAME_LENG == 4 * sizeof(uint64_t), "names are hashed as four words");
+
+    static uint32_t Hash(const char* name){
+        uint64_t w[4];
+        memcpy(w, name, sizeof(w));
+        // The last byte is always forced to zero when stored;
+        w[3] &= ~((uint64_t)0xff << 56);
+        uint64_t hash = (w[0] * 0x9e3779b97f4a7c15ull) ^ (w[1] * 0xc2b2ae3d27d4eb4full) ^
+                        (w[2] * 0x165667b19e3779f9ull) ^ (w[3] * 0xd6e8feb86659fd93ull);
+        return (uint32_t)(hash >> 32) ^ (uint32_t)hash;
+    }
+
+    static bool Equal(const char* a, const char* b){
+        return memcmp(a, b, USB_MONITOR_NAME_LENG - 1) == 0;
+    }
+
+    uint32_t Lookup(const char* name, uint32_t hash) const {
+        size_t mask = mSlots.size() - 1;
+        for (size_t i = hash & mask; ; i = (i + 1) & mask){
+            uint32_t id = mSlots[i];
+            if (id == NONE || (mHashes[id] == hash && Equal(GetName(id), name))){
+                return id;
+            }
+        }
+    }
+
+    void Insert(uint32_t id){
+        size_t mask = mSlots.size() - 1;
+        size_t i = mHashes[id] & mask;
+        while (mSlots[i] != NONE){
+            i = (i + 1) & mask;
+        }
+        mSlots[i] = id;
+    }
+
+    void Grow(){
+        mSlots.assign(mSlots.size() * 2, NONE);
+        for (uint32_t id = 0; id < mHashes.size(); id++){
+            Insert(id);
+        }
+    }
+
+    Name* mChunks[MAX_CHUNKS];
+    std::atomic<uint32_t> mCount;
+    std::atomic<uint64_t> mRejected;   // Intern thread writes only;
+    std::vector<uint32_t> mHashes;  // By id, Intern thread only;
+    std::vector<uint32_t> mSlots;   // Power of two, NONE or an id;
+};
+
+#endif
@@ -2,9 +2,19 @@
 #define __RINGBUFFER_H_
 
 #include <stddef.h>
+#include <assert.h>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// N == 0: the capacity is chosen at runtime and the slots live in a vector.
+// N > 0: the capacity is fixed at compile time, see the specialization below.
+template <typename T, size_t N = 0>
+class RingBuffer;
 
 template <typename T>
-class RingBuffer {
+class RingBuffer<T, 0> {
  public:
     RingBuffer() { Reset(1024); }
 
@@ -53,14 +63,17 @@ class RingBuffer {
 
     void PopBack() {
         if (size_ != 0) {
-        Get(size_ - 1) = T();
+        // Only release what the slot owns, plain data is left in place.
+        if (!std::is_trivially_destructible<T>::value)
+            Get(size_ - 1) = T();
         size_--;
         }
     }
 
     void PopFront() {
         if (size_ != 0) {
-        Get(0) = T();
+        if (!std::is_trivially_destructible<T>::value)
+            Get(0) = T();
         start_ = (start_ + 1) % buffer_.size();
         size_--;
         }
@@ -81,4 +94,129 @@ class RingBuffer {
   size_t start_, size_ = 0;
 };
 
+// Fixed capacity ring over raw storage. Slots are only constructed while they
+// hold a value, so construction touches no slot and the whole buffer can live
+// in static storage or inside another object without a heap allocation.
+template <typename T, size_t N>
+class RingBuffer {
+ public:
+    RingBuffer() {}
+
+    // The capacity is N, a runtime capacity is only checked.
+    explicit RingBuffer(size_t capacity) { assert(capacity <= N); }
+
+    RingBuffer(const RingBuffer& other) {
+        for (size_t i = 0; i < other.size_; i++)
+        Append(other.Get(i));
+    }
+
+    RingBuffer(RingBuffer&& other) noexcept {
+        for (size_t i = 0; i < other.size_; i++)
+        Append(std::move(other.Get(i)));
+        other.Clear();
+    }
+
+    RingBuffer& operator=(const RingBuffer& other) {
+        if (this != &other) {
+        Clear();
+        for (size_t i = 0; i < other.size_; i++)
+            Append(other.Get(i));
+        }
+        return *this;
+    }
+
+    RingBuffer& operator=(RingBuffer&& other) noexcept {
+        if (this != &other) {
+        Clear();
+        for (size_t i = 0; i < other.size_; i++)
+            Append(std::move(other.Get(i)));
+        other.Clear();
+        }
+        return *this;
+    }
+
+    ~RingBuffer() { Clear(); }
+
+    void Append(const T& val) { Emplace(val); }
+
+    void Append(T&& val) { Emplace(std::move(val)); }
+
+    // Constructs the value directly in its slot.
+    template <typename... Args>
+    T& Emplace(Args&&... args) {
+        if (IsFull())
+        PopFront();
+        T* slot = new (Slot(size_)) T(std::forward<Args>(args)...);
+        size_++;
+        return *slot;
+    }
+
+    bool IsEmpty() const { return size_ == 0; }
+
+    bool IsFull() const { return size_ == N; }
+
+    size_t GetSize() const { return size_; }
+
+    size_t GetCapacity() const { return N; }
+
+    T& Get(size_t i) { return *Slot(i); }
+
+    const T& Get(size_t i) const { return *Slot(i); }
+
+    const T& Back() const { return Get(size_ - 1); }
+
+    T& Back() { return Get(size_ - 1); }
+
+    const T& Front() const { return Get(0); }
+
+    T& Front() { return Get(0); }
+
+    void PopBack() {
+        if (size_ != 0) {
+        Destroy(Slot(size_ - 1));
+        size_--;
+        }
+    }
+
+    void PopFront() {
+        if (size_ != 0) {
+        Destroy(Slot(0));
+        start_ = (start_ + 1) % N;
+        size_--;
+        }
+    }
+
+    void Clear() {
+        if (!std::is_trivially_destructible<T>::value) {
+        for (size_t i = 0; i < size_; i++)
+            Destroy(Slot(i));
+        }
+        start_ = size_ = 0;
+    }
+
+    // Same surface as the runtime sized ring, the capacity stays N.
+    void Reset(size_t capacity) {
+        assert(capacity <= N);
+        Clear();
+    }
+
+ private:
+    // N is a compile time constant, so % compiles to a mask for powers of two.
+    T* Slot(size_t i) {
+        return reinterpret_cast<T*>(storage_[(start_ + i) % N]);
+    }
+
+    const T* Slot(size_t i) const {
+        return reinterpret_cast<const T*>(storage_[(start_ + i) % N]);
+    }
+
+    static void Destroy(T* slot) {
+        if (!std::is_trivially_destructible<T>::value)
+        slot->~T();
+    }
+
+    alignas(T) unsigned char storage_[N][sizeof(T)];
+    size_t start_ = 0, size_ = 0;
+};
+
 #endif
@@ -0,0 +1,135 @@
+#ifndef __SPSC_RINGBUFFER_H_
+#define __SPSC_RINGBUFFER_H_
+
+#include <stddef.h>
+#include <atomic>
+#include <utility>
+#include <vector>
+
+// Single-producer/single-consumer ring without locks.
+//
+// One thread calls Append, the other PopFront/Front; neither blocks. The
+// indexes run freely and are masked, so the capacity is always a power of
+// two. Unlike RingBuffer, Append never evicts: the slots between head and
+// tail belong to the consumer, so a full ring rejects the new value.
+template <typename T>
+class SpscRingBuffer {
+ public:
+    SpscRingBuffer() { Reset(1024); }
+
+    explicit SpscRingBuffer(size_t capacity) { Reset(capacity); }
+
+    SpscRingBuffer(const SpscRingBuffer& other) = delete;
+    SpscRingBuffer& operator=(const SpscRingBuffer& other) = delete;
+
+    // Producer side.
+    bool Append(const T& val) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_cache_ == buffer_.size()) {
+            head_cache_ = head_.load(std::memory_order_acquire);
+            if (tail - head_cache_ == buffer_.size())
+                return false;
+        }
+        buffer_[tail & mask_] = val;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool Append(T&& val) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_cache_ == buffer_.size()) {
+            head_cache_ = head_.load(std::memory_order_acquire);
+            if (tail - head_cache_ == buffer_.size())
+                return false;
+        }
+        buffer_[tail & mask_] = std::move(val);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Appends up to count values with a single publish, returns how many fit.
+    size_t AppendBatch(const T* vals, size_t count) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t space = buffer_.size() - (tail - head_cache_);
+        if (space < count) {
+            head_cache_ = head_.load(std::memory_order_acquire);
+            space = buffer_.size() - (tail - head_cache_);
+        }
+        if (count > space)
+            count = space;
+        for (size_t i = 0; i < count; i++)
+            buffer_[(tail + i) & mask_] = vals[i];
+        tail_.store(tail + count, std::memory_order_release);
+        return count;
+    }
+
+    // Consumer side.
+    T& Front() { return buffer_[head_.load(std::memory_order_relaxed) & mask_]; }
+
+    const T& Front() const {
+        return buffer_[head_.load(std::memory_order_relaxed) & mask_];
+    }
+
+    void PopFront() {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head != tail_.load(std::memory_order_acquire))
+            head_.store(head + 1, std::memory_order_release);
+    }
+
+    // Moves up to count values out with a single release, returns how many.
+    size_t PopFrontBatch(T* vals, size_t count) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        size_t size = tail_.load(std::memory_order_acquire) - head;
+        if (count > size)
+            count = size;
+        for (size_t i = 0; i < count; i++)
+            vals[i] = std::move(buffer_[(head + i) & mask_]);
+        head_.store(head + count, std::memory_order_release);
+        return count;
+    }
+
+    // Either side; exact only on the consumer.
+    bool IsEmpty() const {
+        return head_.load(std::memory_order_acquire) ==
+               tail_.load(std::memory_order_acquire);
+    }
+
+    bool IsFull() const { return GetSize() == buffer_.size(); }
+
+    size_t GetSize() const {
+        return tail_.load(std::memory_order_acquire) -
+               head_.load(std::memory_order_acquire);
+    }
+
+    size_t GetCapacity() const { return buffer_.size(); }
+
+    // Not thread safe, only while neither side is running.
+    void Clear() { Reset(GetCapacity()); }
+
+    void Reset(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        buffer_.clear();
+        buffer_.resize(size);
+        mask_ = size - 1;
+        head_.store(0, std::memory_order_relaxed);
+        tail_.store(0, std::memory_order_relaxed);
+        head_cache_ = 0;
+    }
+
+ private:
+    static const size_t kCacheLine = 64;
+
+    std::vector<T> buffer_;
+    size_t mask_ = 0;
+    // Written by the consumer.
+    alignas(kCacheLine) std::atomic<size_t> head_{0};
+    // Written by the producer, with its last view of head_ next to it so a
+    // non-full ring never touches the consumer's cache line.
+    alignas(kCacheLine) std::atomic<size_t> tail_{0};
+    size_t head_cache_ = 0;
+    char pad_[kCacheLine - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+};
+
+#endif
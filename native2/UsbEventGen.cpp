@@ -0,0 +1,237 @@
+/**
+    Synthetic usb_monitor event generator
+    @file UsbEventGen.cpp
+
+    Writes struct usb_message_t records back to back, exactly as read() on
+    /proc/usb_monitor returns them, to stdout or a FIFO, so UsbMonitorApp can
+    be driven with "source=" without the driver or any hardware.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include "UsbInfo.h"
+
+// Records per write(), 32 KB;
+#define WRITE_BATCH             256
+
+#define PATTERN_STEADY           0   // Round robin over the devices, evenly paced;
+#define PATTERN_BURST            1   // Same events, burst at a time with pauses in between;
+#define PATTERN_FLAP             2   // Each device toggles flaps times in a row;
+#define PATTERN_NAMES            3   // Steady over many distinct devices;
+
+struct GenOptions {
+    int      pattern;
+    uint64_t rate;          // Events per second, 0 = as fast as the reader takes them;
+    uint64_t count;         // Events to write, 0 = until killed;
+    uint32_t names;         // Distinct devices;
+    uint32_t burst;         // Events per burst;
+    uint32_t flaps;         // Toggles per device in PATTERN_FLAP;
+    uint64_t gap;           // Skip a sequence number every gap events, 0 = never;
+    const char* out;        // FIFO or file, NULL = stdout;
+};
+
+static int64_t NowNs(){
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Fill the record of event i
+ *
+ * @param options;
+ * @param i: event number;
+ * @param sequence: sequence number of the record;
+ * @param time: kernel_time;
+ * @param OUT message;
+ */
+static void MakeRecord(const GenOptions& options, uint64_t i, uint64_t sequence, int64_t time,
+                       struct usb_message_t* message){
+        uint32_t device;
+        uint64_t pass;
+
+        if (options.pattern == PATTERN_FLAP){
+            device = (uint32_t)((i / options.flaps) % options.names);
+            pass = i;
+        }else{
+            device = (uint32_t)(i % options.names);
+            pass = i / options.names;
+        }
+
+        memset(message, 0, sizeof(*message));
+        message->kernel_time = time;
+        message->sequence = sequence;
+        // Every device starts plugged out, so it alternates in and out,
+        // 1 is plug in and 0 plug out as in usb_message_t;
+        message->plug_flag = pass % 2 == 0 ? 1 : 0;
+        message->speed = 3;
+        // A new devnum on every plug in, the plug out keeps it;
+        message->devnum = (__u8)(1 + (device + pass / 2) % 127);
+        message->busnum = (__u16)(1 + device % 8);
+        message->vendor = 0x1d6b;
+        message->product = (__u16)device;
+        message->bcd_device = 0x0100;
+        snprintf(message->usb_name, sizeof(message->usb_name), "gen-device-%u", device);
+        snprintf(message->serial, sizeof(message->serial), "SN%08u", device);
+}
+
+/**
+ * Write the whole buffer
+ *
+ * @return 0 on success, errno otherwise;
+ */
+static int WriteAll(int fd, const char* buf, size_t leng){
+        while (leng > 0){
+            ssize_t written = write(fd, buf, leng);
+            if (written < 0){
+                if (errno == EINTR){
+                    continue;
+                }
+                return errno;
+            }
+            buf += written;
+            leng -= written;
+        }
+        return 0;
+}
+
+/**
+ * Sleep until the absolute CLOCK_MONOTONIC time due
+ */
+static void SleepUntil(int64_t due){
+        struct timespec ts;
+        ts.tv_sec = due / 1000000000;
+        ts.tv_nsec = due % 1000000000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR){
+        }
+}
+
+static int ParseOptions(int argc, char* argv[], GenOptions* options){
+        bool names = false;
+
+        memset(options, 0, sizeof(*options));
+        options->pattern = PATTERN_STEADY;
+        options->count = 1000000;
+        options->names = 16;
+        options->burst = 4096;
+        options->flaps = 100;
+        for (int i = 1; i < argc; i++){
+            if (strcmp(argv[i], "pattern=steady") == 0){
+                options->pattern = PATTERN_STEADY;
+            }else if (strcmp(argv[i], "pattern=burst") == 0){
+                options->pattern = PATTERN_BURST;
+            }else if (strcmp(argv[i], "pattern=flap") == 0){
+                options->pattern = PATTERN_FLAP;
+            }else if (strcmp(argv[i], "pattern=names") == 0){
+                options->pattern = PATTERN_NAMES;
+            }else if (strncmp(argv[i], "rate=", 5) == 0){
+                options->rate = strtoull(argv[i] + 5, NULL, 10);
+            }else if (strncmp(argv[i], "count=", 6) == 0){
+                options->count = strtoull(argv[i] + 6, NULL, 10);
+            }else if (strncmp(argv[i], "names=", 6) == 0){
+                options->names = (uint32_t)strtoul(argv[i] + 6, NULL, 10);
+                names = true;
+            }else if (strncmp(argv[i], "burst=", 6) == 0){
+                options->burst = (uint32_t)strtoul(argv[i] + 6, NULL, 10);
+            }else if (strncmp(argv[i], "flaps=", 6) == 0){
+                options->flaps = (uint32_t)strtoul(argv[i] + 6, NULL, 10);
+            }else if (strncmp(argv[i], "gap=", 4) == 0){
+                options->gap = strtoull(argv[i] + 4, NULL, 10);
+            }else if (strncmp(argv[i], "out=", 4) == 0){
+                options->out = argv[i] + 4;
+            }else{
+                return -1;
+            }
+        }
+        if (options->pattern == PATTERN_NAMES && !names){
+            options->names = 65536;
+        }
+        return options->names > 0 && options->burst > 0 && options->flaps > 0 ? 0 : -1;
+}
+
+int main(int argc, char* argv[]){
+
+    // "UsbEventGen [pattern=steady|burst|flap|names] [rate=N] [count=N] [names=N] [burst=N] [flaps=N]
+    //  [gap=N] [out=PATH]":
+    // rate is in events per second, 0 writes as fast as the reader takes them,
+    // count 0 writes until killed,
+    // gap skips a sequence number every N events, as if the driver dropped one,
+    // out is a FIFO made with mkfifo, or stdout when left out;
+    GenOptions options;
+    if (ParseOptions(argc, argv, &options) != 0){
+        fprintf(stderr, "usage: UsbEventGen [pattern=steady|burst|flap|names] [rate=N] [count=N] [names=N] "
+                "[burst=N] [flaps=N] [gap=N] [out=PATH] \n");
+        return -1;
+    }
+
+    int fd = STDOUT_FILENO;
+    if (options.out != NULL){
+        // Blocks until the reader opens the FIFO;
+        fd = open(options.out, O_WRONLY);
+        if (fd == -1){
+            fprintf(stderr, "open %s failed, errno = %d \n", options.out, errno);
+            return -1;
+        }
+    }
+    // A reader going away ends the run through EPIPE;
+    signal(SIGPIPE, SIG_IGN);
+
+    // Bursts go out whole, otherwise about a millisecond of events per write;
+    uint64_t batch = WRITE_BATCH;
+    if (options.pattern != PATTERN_BURST && options.rate > 0){
+        batch = options.rate / 1000;
+        batch = batch < 1 ? 1 : (batch > WRITE_BATCH ? WRITE_BATCH : batch);
+    }
+
+    static struct usb_message_t records[WRITE_BATCH];
+    uint64_t written = 0, sequence = 0;
+    int64_t start = NowNs();
+    int ret = 0;
+
+    while (options.count == 0 || written < options.count){
+        uint64_t n = batch;
+        if (options.pattern == PATTERN_BURST){
+            n = options.burst - written % options.burst;
+            n = n > WRITE_BATCH ? WRITE_BATCH : n;
+        }
+        if (options.count != 0 && n > options.count - written){
+            n = options.count - written;
+        }
+
+        int64_t time = NowNs();
+        for (uint64_t i = 0; i < n; i++){
+            if (options.gap != 0 && (written + i) % options.gap == options.gap - 1){
+                sequence++;
+            }
+            MakeRecord(options, written + i, sequence++, time, &records[i]);
+        }
+        ret = WriteAll(fd, (const char*)records, n * sizeof(records[0]));
+        if (ret != 0){
+            fprintf(stderr, "write failed, errno = %d \n", ret);
+            break;
+        }
+        written += n;
+
+        // Pace by the total so far, so a late write does not lower the rate;
+        // a burst pauses only once it is whole;
+        if (options.rate > 0 && (options.pattern != PATTERN_BURST || written % options.burst == 0)){
+            int64_t due = start + (int64_t)(written * 1000000000.0 / options.rate);
+            if (due > NowNs()){
+                SleepUntil(due);
+            }
+        }
+    }
+
+    double seconds = (NowNs() - start) / 1e9;
+    fprintf(stderr, "wrote %llu events in %.3f s, %.0f events/s \n", (unsigned long long)written, seconds,
+            seconds > 0 ? written / seconds : 0.0);
+    if (fd != STDOUT_FILENO){
+        close(fd);
+    }
+    return ret == 0 ? 0 : -1;
+}
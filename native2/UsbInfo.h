@@ -1,29 +1,95 @@
 #ifndef __USB_INFO_H_
 #define __USB_INFO_H_
 
+#include <stdint.h>
 #include <linux/types.h>
 #include <linux/ioctl.h>
 
-#define CMD_GET_STATUS	_IOR(0xFF, 123, unsigned char) 
+// Records, ring header and ioctls shared with usb_driver.c;
+#include "../usb_monitor_abi.h"
 
 #define DEV_NAME "/proc/usb_monitor"
 
-#define MAX_EPOLL_EVENTS         1
-#define KERNEL_DATA_LENG        128
+#define MAX_EPOLL_EVENTS        16
+#define STATS_INTERVAL_MS     5000
+#define KERNEL_MESSAGE_SIZE     (sizeof(struct usb_message_t))
+
+// One read() drains up to this many messages;
+#define KERNEL_BATCH_COUNT       64
+#define KERNEL_DATA_LENG        (KERNEL_MESSAGE_SIZE * KERNEL_BATCH_COUNT)
 #define MONITOR_DISABLE       0x00
 #define MONITOR_ENABLE        0xff
 
+// Ways of getting messages out of the driver;
+#define BACKEND_READ             0   // read() copies a batch into mBuf;
+#define BACKEND_MMAP             1   // messages are copied out of the shared ring;
+#define BACKEND_URING            2   // io_uring keeps URING_DEPTH reads in flight;
+
+#define URING_DEPTH              4
+
+// Where records come from;
+#define SOURCE_DRIVER            0   // DEV_NAME, with its ioctls and shared ring;
+#define SOURCE_STREAM            1   // A pipe, FIFO or socket carrying the same records back to back,
+                                     // e.g. from UsbEventGen; read() only, no filters or driver stats;
+
+// Default directory of the on-disk journal, see EventJournal.h;
+#define JOURNAL_DIR "/var/lib/usb_monitor"
+
+// Event server, see EventServer.h;
+#define SERVER_SOCKET "/run/usb_monitor.sock"
+#define SERVER_HISTORY        4096   // Records a client may lag before it is dropped;
+#define SERVER_MAX_CLIENTS    1024
+
+// Debouncer, see Debouncer.h;
+#define DEBOUNCE_MAX_DEVICES  4096
+#define DEBOUNCE_TICK_MS        50   // How often held devices are checked for quiet;
+#define DEBOUNCE_CONTROL "/run/usb_monitor.debounce"   // New window in ms, read on SIGHUP;
+
 size_t BUFFER_SIZE = 1024;
+// Compile time capacity of the default fifo, BUFFER_SIZE must not exceed it;
+#define MAX_BUFFER_SIZE       1024
 
-struct DataInfo{
-    uint8_t kernel_time[8];       //8 Byte
-    uint8_t status;               //1 byte
-    int8_t  name[128];            //128 byte
+// The driver record itself, so a batch from read() or the mmap'd ring
+// is an array of UsbMonitorInfo without any decoding;
+class UsbMonitorInfo {
+public:
+    struct usb_message_t info;
 };
 
-class UsbMonitorInfo {
+static_assert(sizeof(UsbMonitorInfo) == sizeof(struct usb_message_t),
+              "UsbMonitorInfo must overlay struct usb_message_t");
+
+// What the fifo keeps of a record: the name and serial are interned into
+// NameTables, so two events share a cache line instead of one taking two;
+class UsbMonitorEvent {
 public:
-    struct DataInfo info;
+    int64_t  kernel_time;
+    uint32_t name_id;       // NameTable id of usb_name;
+    uint32_t serial_id;     // Id of serial in a NameTable of its own;
+    uint32_t sequence;      // Low bits of the driver sequence, enough to order neighbours;
+    uint16_t vendor;
+    uint16_t product;
+    uint16_t busnum;
+    uint8_t  devnum;
+    uint8_t  speed;
+    uint8_t  plug_flag;
+    uint8_t  device_class;
+    uint16_t flaps;         // Events of the device coalesced into this one, see Debouncer.h;
+};
+
+static_assert(sizeof(UsbMonitorEvent) == 32, "UsbMonitorEvent must stay 32 bytes");
+
+// Where events were lost during a run, see UsbMonitorDevice::GetStats;
+struct UsbMonitorStats {
+    struct usb_monitor_stats_t driver;  // CMD_GET_STATS, counted since the module was loaded;
+    struct usb_monitor_counters_t counters;    // CMD_GET_COUNTERS, since the module was loaded;
+    struct usb_monitor_cursor_t cursor;   // CMD_GET_CURSOR, of this open file;
+    uint64_t received;      // Records read from the driver;
+    uint64_t gaps;          // Times the driver sequence skipped;
+    uint64_t lost;          // Sequence numbers skipped, events the driver dropped while we ran;
+    uint64_t reordered;     // Times the driver sequence went back;
+    uint64_t overflowed;    // Events the fifo lost: evicted, rejected when full or lapping a subscriber;
+    uint64_t unindexed;     // Events kept out of the device index, their name or serial table was full;
 };
 
 #endif
@@ -4,203 +4,775 @@
     @author Wang Taorui
     @version 2022/8/14
 */
+#include <algorithm>
 #include <cinttypes>
 #include <numeric>
 #include <set>
 #include <string>
+#include <stdlib.h>
 #include <string.h>
 #include <tuple>
+#include <type_traits>
 #include <vector>
 #include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <pthread.h>
 #include <unistd.h>
-#include "RingBuffer.h"
-#include "UsbInfo.h"
+#include "EventLoop.h"
+#include "UsbMonitorDevice.h"
 
 using namespace std;
 
-pthread_mutex_t data_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t  fifo_nonzero;
-static volatile int64_t isEmpty = 0;
-static volatile int64_t fifo_size = 0;
+static volatile bool consumerExit = false;
+static BroadcastRing<UsbMonitorEvent>::WaitStrategy broadcastWait = BroadcastRing<UsbMonitorEvent>::WAIT_FUTEX;
+static volatile uint64_t plugInCount = 0, plugOutCount = 0;   // Kept by DoEventMetrics;
+static struct usb_monitor_filters_t filters;   // Installed in the driver while running if count > 0;
+static uint32_t stressEvents = 0;               // Per CPU, CMD_STRESS run next to the reader, 0 = none;
+static uint32_t stressFlags = 0;                // USB_MONITOR_STRESS_*;
 
-class UsbMonitorDevice {
-public:
-    UsbMonitorDevice(char* name){
-        mDev_name = name;
-    }
+/**
+ * Consume the records handed over by DoUsbMonitor through the lock-free fifo
+ *
+ * @param arg: UsbMonitorDevice<SpscRingBuffer<UsbMonitorEvent> >;
+ */
+static void * DoUsbConsumer(void *arg){
+        size_t count = 0;
+        UsbMonitorEvent deviceinfo[KERNEL_BATCH_COUNT];
+        UsbMonitorDevice<SpscRingBuffer<UsbMonitorEvent> >* device =
+            (UsbMonitorDevice<SpscRingBuffer<UsbMonitorEvent> >*)arg;
+
+        while(!consumerExit){
+            count = device->PopFrontDatainfoBatch(deviceinfo, KERNEL_BATCH_COUNT);
+            if (count > 0){
+                RecordLatency(LATENCY_CONSUMER, deviceinfo, count);
+                LOGD("Consumed %ld records, last: %s \n", count, device->GetName(deviceinfo[count - 1].name_id));
+                continue;
+            }
 
-    ~UsbMonitorDevice(){
-        epoll_ctl(mEpollfd, EPOLL_CTL_DEL, mFd, &mEpev);
-        close(mEpollfd);
-        close(mFd);
-    }
+            // Sleep until the reader signals new records;
+            pthread_mutex_lock(&data_mutex);
+            __atomic_add_fetch(&isEmpty, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            while (device->FifoIsEmpty() && !consumerExit){
+                pthread_cond_wait(&fifo_nonzero, &data_mutex);
+            }
+            __atomic_sub_fetch(&isEmpty, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&data_mutex);
+        }
+        return NULL;
+}
 
-    int InitSetup(){
-        //open "/proc/usb_monitor"
-        mFd = open(mDev_name, O_RDWR); 
-        if (mFd == -1) {
-        printf("open %s fail, Check!!!\n",mDev_name);
-            return errno;
+/**
+ * Subscribe to the broadcast ring and hand every batch taken to fn
+ *
+ * Returns once the ring is shut down;
+ *
+ * @param device;
+ * @param tag: subscriber name for the logs;
+ * @param stage: LatencyStage of this subscriber;
+ * @param fn: called with each batch;
+ */
+template <typename Fn>
+static void RunSubscriber(UsbMonitorDevice<BroadcastRing<UsbMonitorEvent> >* device, const char* tag, int stage, Fn fn){
+        UsbMonitorEvent events[KERNEL_BATCH_COUNT];
+        uint64_t lost = 0;
+        size_t count;
+
+        int subscriber = device->FifoSubscribe(broadcastWait);
+        if (subscriber < 0){
+            LOGE("%s: no free subscriber slot \n", tag);
+            return;
         }
-        //epoll
-        mEpollfd = epoll_create(MAX_EPOLL_EVENTS);
-        if (mEpollfd == -1) {
-            printf("epoll_create failed errno = %d ", errno);	
-            return errno;
+
+        while ((count = device->TakeDatainfoBatch(subscriber, events, KERNEL_BATCH_COUNT, &lost)) > 0){
+            // Slow consumer, the producer lapped it;
+            if (lost > 0){
+                LOGW("%s fell behind, lost %llu records \n", tag, (unsigned long long)lost);
+                device->CountOverflowed(lost);
+                lost = 0;
+            }
+            RecordLatency(stage, events, count);
+            fn(events, count);
         }
-        printf("epoll_create ok epollfd= %d \n", mEpollfd);
+}
+
+/**
+ * Broadcast subscriber writing every event to the log
+ *
+ * @param arg: UsbMonitorDevice<BroadcastRing<UsbMonitorEvent> >;
+ */
+static void * DoEventLogger(void *arg){
+        UsbMonitorDevice<BroadcastRing<UsbMonitorEvent> >* device =
+            (UsbMonitorDevice<BroadcastRing<UsbMonitorEvent> >*)arg;
+
+        RunSubscriber(device, "logger", LATENCY_LOGGER, [device](const UsbMonitorEvent* events, size_t count){
+            for (size_t i = 0; i < count; i++){
+                LOGD("kernel_time = %lld Device name: %s %04x:%04x bus %u dev %u serial %s flaps %u ====== %s \n",
+                     (long long)events[i].kernel_time, device->GetName(events[i].name_id), events[i].vendor,
+                     events[i].product, events[i].busnum, events[i].devnum, device->GetSerial(events[i].serial_id),
+                     events[i].flaps, events[i].plug_flag == 1 ? "PLUG IN" : "PLUG OUT");
+            }
+        });
+        return NULL;
+}
 
-        //add fd for epoll
-        memset(&mEpev, 0, sizeof(mEpev));
-        mEpev.data.fd = mFd;
-        mEpev.events = EPOLLIN;
-        if (epoll_ctl(mEpollfd, EPOLL_CTL_ADD, mFd, &mEpev) < 0) {
-            printf("epoll_ctl failed, errno = %d \n", errno);
-            return errno;
+/**
+ * Broadcast subscriber counting plug in and plug out events
+ *
+ * @param arg: UsbMonitorDevice<BroadcastRing<UsbMonitorEvent> >;
+ */
+static void * DoEventMetrics(void *arg){
+        UsbMonitorDevice<BroadcastRing<UsbMonitorEvent> >* device =
+            (UsbMonitorDevice<BroadcastRing<UsbMonitorEvent> >*)arg;
+
+        RunSubscriber(device, "metrics", LATENCY_METRICS, [](const UsbMonitorEvent* events, size_t count){
+            uint64_t in = 0;
+            for (size_t i = 0; i < count; i++){
+                in += events[i].plug_flag == 1;
+            }
+            __atomic_add_fetch(&plugInCount, in, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&plugOutCount, count - in, __ATOMIC_RELAXED);
+        });
+        return NULL;
+}
+
+/**
+ * Make the consumer threads sleeping on fifo_nonzero return
+ *
+ * Broadcast subscribers sleep in the ring instead, FifoShutdown wakes them;
+ */
+static void StopConsumers(){
+        pthread_mutex_lock(&data_mutex);
+        consumerExit = true;
+        pthread_cond_broadcast(&fifo_nonzero);
+        pthread_mutex_unlock(&data_mutex);
+}
+
+/**
+ * Save the summaries of the devices the debouncer held
+ *
+ * @param device;
+ * @param all: every held device, else only those quiet for a window;
+ *
+ * @return 0 on success;
+ */
+template <typename Device>
+static int ExpireDataInfo(Device* device, bool all){
+        UsbMonitorInfo summary[KERNEL_BATCH_COUNT];
+        size_t count = 0;
+        int ret = 0;
+        auto emit = [&](const UsbMonitorInfo& info){
+            summary[count++] = info;
+            if (count == KERNEL_BATCH_COUNT){
+                ret |= SaveDataInfo(device, summary, count);
+                count = 0;
+            }
+        };
+
+        if (all){
+            debouncer->Flush(emit);
+        }else{
+            debouncer->Expire(MonotonicNs(), emit);
         }
-        return 0;
-    }
+        if (count > 0){
+            ret |= SaveDataInfo(device, summary, count);
+        }
+        return ret;
+}
+
+/**
+ * Save everything the driver has queued
+ *
+ * The node is watched edge triggered, so it is drained until the driver
+ * reports it empty;
+ *
+ * @param device;
+ *
+ * @return 0 on success, 1 once a stream has ended;
+ */
+template <typename Device>
+static int DrainUsbMonitor(Device* device){
+        ssize_t leng = 0;
+        uint32_t count = 0;
+        const UsbMonitorInfo* deviceinfo;
+        char* buf = device->getBuffer();
 
-    int getFd() { return mFd; };
-    int getepollfd() { return mEpollfd; };
-    char* getBuffer() { return mBuf; };
+        if (device->getBackend() == BACKEND_MMAP){
+            // Copy out of the shared ring, no syscall while it has data;
+            while (device->GetPendingCount() > 0){
+                deviceinfo = device->CopyMessages(&count);
+                if (count > 0 && ReceiveDataInfo(device, deviceinfo, count) != 0){
+                    return -1;
+                }
+            }
+            return 0;
+        }
 
-    UsbMonitorInfo& GetFristDataInfo(){
-        return mRingBuffer.Get(0);
-    }
-    void PPopFrontDatainfo(){
-        mRingBuffer.PopFront();
-    }
+        while(1){
+            // Max KERNEL_BATCH_COUNT messages per read;
+            // Set this parameter in UsbInfo.h;
+            size_t partial = device->getPartial();
+            leng  = read(device->getFd(), buf + partial, KERNEL_DATA_LENG - partial);
 
-    void PopBackDatainfo(){
-        mRingBuffer.PopBack();
-    }
+            if (leng < 0){
+                if (errno == EINTR){
+                    continue;
+                }
+                if (errno == EAGAIN){
+                    return 0;
+                }
+                LOGE("usb_monitor read failed; errno=%d\n", errno);
+                return -1;
+            }
+            if (leng == 0){
+                // The driver never has an end, a stream's writer closed it;
+                return device->getSource() == SOURCE_STREAM ? 1 : 0;
+            }
 
-    UsbMonitorInfo& GetBackDataInfo(){
-        return mRingBuffer.Back();
-    }
+            LOGD("The length of device information is %ld\n",leng);
 
-    void AppendDatainfo(UsbMonitorInfo& info){
-        mRingBuffer.Append(info);
-    }
+            // The driver only returns whole messages, the buffer is an array of records;
+            leng += partial;
+            deviceinfo = (const UsbMonitorInfo*)buf;
+            count = leng / KERNEL_MESSAGE_SIZE;
 
-    size_t GetFifoSize(){
-        return mRingBuffer.GetSize();
-    }
+            if (count > 0 && ReceiveDataInfo(device, deviceinfo, count) != 0){
+                return -1;
+            }
+            device->setPartial(leng - count * KERNEL_MESSAGE_SIZE);
+            memmove(buf, buf + count * KERNEL_MESSAGE_SIZE, device->getPartial());
+        }
+}
 
-    void FifoReset(size_t capacity) {
-        mRingBuffer.Reset(capacity);
-    }
+#ifdef USB_MONITOR_HAVE_IO_URING
+/**
+ * Save the reads completed by io_uring and put their buffers back in flight
+ *
+ * Each read takes a contiguous run of the driver queue, but completions of
+ * concurrent reads may be posted out of order, so a reaped batch is put back
+ * in queue order by the sequence of its first record. Returns once a pass
+ * brings no data, the next completion wakes the event loop again;
+ *
+ * @param device;
+ *
+ * @return 0 on success;
+ */
+template <typename Device>
+static int DrainUring(Device* device){
+        struct io_uring_cqe cqes[URING_DEPTH];
+        unsigned count, i;
+        IoUring* uring = device->getUring();
+
+        while ((count = uring->ReapCompletions(cqes, URING_DEPTH)) > 0){
+            bool data = false;
+            std::sort(cqes, cqes + count, [device](const struct io_uring_cqe& a, const struct io_uring_cqe& b){
+                if (a.res <= 0 || b.res <= 0){
+                    return a.res > b.res;
+                }
+                return ((const UsbMonitorInfo*)device->getUringBuffer(a.user_data))->info.sequence <
+                       ((const UsbMonitorInfo*)device->getUringBuffer(b.user_data))->info.sequence;
+            });
+
+            for (i = 0; i < count; i++){
+                if (cqes[i].res > 0){
+                    data = true;
+                    const UsbMonitorInfo* deviceinfo = (const UsbMonitorInfo*)device->getUringBuffer(cqes[i].user_data);
+                    if (ReceiveDataInfo(device, deviceinfo, cqes[i].res / KERNEL_MESSAGE_SIZE) != 0){
+                        return -1;
+                    }
+                }else if (cqes[i].res < 0 && cqes[i].res != -EAGAIN && cqes[i].res != -EINTR){
+                    LOGE("usb_monitor io_uring read failed; errno=%d\n", -cqes[i].res);
+                    return -1;
+                }
+                device->QueueUringRead(cqes[i].user_data);
+            }
 
-    bool FifoIsEmpty() {
-        return mRingBuffer.IsEmpty();
-    }
+            if (uring->Submit(0) != 0){
+                LOGE("usb_monitor io_uring submit failed; errno=%d\n", errno);
+                return -1;
+            }
+            if (!data){
+                break;
+            }
+        }
+        return 0;
+}
+#endif
 
-private:
-    int mFd; //"/proc/usb_monitor"
-    int mEpollfd;
-    struct epoll_event mEpev;
-    char *mDev_name;
-    char mBuf[50];
-    RingBuffer<UsbMonitorInfo> mRingBuffer;
-};
+/**
+ * Read the debounce window written to DEBOUNCE_CONTROL
+ *
+ * @return the window in ms, -1 if there is none;
+ */
+static long ReadDebounceWindow(){
+        long ms = -1;
+        FILE* file = fopen(DEBOUNCE_CONTROL, "r");
+        if (file == NULL){
+            LOGW("open %s failed, errno = %d \n", DEBOUNCE_CONTROL, errno);
+            return -1;
+        }
+        if (fscanf(file, "%ld", &ms) != 1 || ms < 0){
+            LOGW("%s holds no window in ms \n", DEBOUNCE_CONTROL);
+            ms = -1;
+        }
+        fclose(file);
+        return ms;
+}
 
 /**
  * Monitor USB device plugging and unplugging status, and output and record that status
  *
+ * Runs an event loop on the calling thread multiplexing the /proc node, a
+ * periodic stats timer and SIGINT/SIGTERM, until a signal asks it to stop.
+ * SIGINT, SIGTERM and SIGUSR1, which logs the latency histograms, must
+ * already be blocked, see EventLoop::BlockSignals, and SIGHUP too with the
+ * debouncer, which it makes reread DEBOUNCE_CONTROL.
+ *
  * @param arg: device name; /proc/usb_monitor;
  */
+template <typename Device>
 static void * DoUsbMonitor(void *arg){
-        int ret;
-        //static int index = 0;
-        ssize_t leng = 0, i = 0;
-        struct epoll_event epev;
-        UsbMonitorInfo deviceinfo;
-        UsbMonitorDevice* device = (UsbMonitorDevice*)arg;
-        char* buf = device->getBuffer();
-        device->FifoReset(BUFFER_SIZE);
+        Device* device = (Device*)arg;
+        EventLoop loop(MAX_EPOLL_EVENTS);
+        int failed = 0;
 
-        while(1){
-            printf("usb_monitor epoll_wait... \n");
-            ret = epoll_wait(device->getepollfd(), &epev, MAX_EPOLL_EVENTS, -1);
-            if (ret == -1 && errno != EINTR) {
-                printf("usb_monitor epoll_wait failed; errno=%d\n", errno);
-                return (void*)(-1);
+        if (loop.InitSetup() != 0){
+            return (void *)(-1);
+        }
+
+#ifdef USB_MONITOR_HAVE_IO_URING
+        // The reads are already in flight, the ring fd reports their completions;
+        if (device->getBackend() == BACKEND_URING){
+            if (loop.AddFd(device->getUring()->getFd(), EPOLLIN, [&](uint32_t){
+                    if (DrainUring(device) != 0){
+                        failed = 1;
+                        loop.Stop();
+                    }
+                    if (server != NULL){
+                        server->Flush();
+                    }
+                }) != 0){
+                return (void *)(-1);
             }
+        }else
+#endif
+        if (loop.AddFd(device->getFd(), EPOLLIN | EPOLLET, [&](uint32_t){
+                int drained = DrainUsbMonitor(device);
+                if (drained != 0){
+                    if (drained < 0){
+                        failed = 1;
+                    }else{
+                        LOGI("event stream ended \n");
+                    }
+                    loop.Stop();
+                }
+                if (server != NULL){
+                    server->Flush();
+                }
+            }) != 0){
+            return (void *)(-1);
+        }
 
-            // Max 128 byte;
-            // Set this parameter in UsbInfo.h;
-            leng  = read(device->getFd(), buf, KERNEL_DATA_LENG);
+        if (loop.AddTimer(STATS_INTERVAL_MS, [&](uint64_t){
+                LOGI("Current BufferSize = %ld, attached devices = %lu, plug in/out = %llu/%llu, clients = %lu \n",
+                     fifo_size, (unsigned long)device->GetAttachedCount(), (unsigned long long)plugInCount,
+                     (unsigned long long)plugOutCount, (unsigned long)(server != NULL ? server->GetClientCount() : 0));
+                UsbMonitorStats stats;
+                if (device->GetStats(&stats) == 0){
+                    LOGI("driver recorded/dropped/filtered = %llu/%llu/%llu, read = %llu, lost = %llu in %llu gaps, lapped = %llu, fifo overflowed = %llu, unindexed = %llu \n",
+                         (unsigned long long)stats.driver.recorded, (unsigned long long)stats.driver.dropped,
+                         (unsigned long long)stats.driver.filtered, (unsigned long long)stats.received,
+                         (unsigned long long)stats.lost, (unsigned long long)stats.gaps,
+                         (unsigned long long)stats.cursor.missed, (unsigned long long)stats.overflowed,
+                         (unsigned long long)stats.unindexed);
+                }
+                if (debouncer != NULL){
+                    LOGI("debounce window = %lld ms, held = %lu, coalesced = %llu into %llu summaries \n",
+                         (long long)(debouncer->GetWindow() / 1000000), (unsigned long)debouncer->GetHeldCount(),
+                         (unsigned long long)debouncer->GetCoalescedCount(),
+                         (unsigned long long)debouncer->GetSummaryCount());
+                }
+                if (journal != NULL){
+                    journal->Flush();
+                }
+            }) != 0){
+            return (void *)(-1);
+        }
 
-            if (leng > 0){
-                printf("The length of device information is %d\n",leng);
+        if (debouncer != NULL){
+            if (loop.AddTimer(DEBOUNCE_TICK_MS, [&](uint64_t){
+                    if (ExpireDataInfo(device, false) != 0){
+                        failed = 1;
+                        loop.Stop();
+                    }
+                    if (server != NULL){
+                        server->Flush();
+                    }
+                }) != 0){
+                return (void *)(-1);
+            }
 
-                // Record kernel time;
-                // size : 8 Bytes;
-                for (i = 0; i < 8; i++){
-                    deviceinfo.info.kernel_time[i] = buf[i];
-                    printf("kernel_time[%d] = 0x%x \n", i, deviceinfo.info.kernel_time[i]);
-                }
+            if (loop.AddSignals({SIGHUP}, [&](int){
+                    long ms = ReadDebounceWindow();
+                    if (ms >= 0){
+                        debouncer->SetWindow((int64_t)ms * 1000000);
+                        LOGI("debounce window set to %ld ms \n", ms);
+                    }
+                }) != 0){
+                return (void *)(-1);
+            }
+        }
 
-                // Record USB plugging status;
-                deviceinfo.info.status = buf[8];
+        if (loop.AddSignals({SIGINT, SIGTERM}, [&](int signo){
+                LOGI("usb_monitor got signal %d, exit\n", signo);
+                loop.Stop();
+            }) != 0){
+            return (void *)(-1);
+        }
 
-                // Record USB device name;
-                memcpy(deviceinfo.info.name, buf+9,leng-9);
+        if (loop.AddSignals({SIGUSR1}, [&](int){
+                ReportLatency();
+            }) != 0){
+            return (void *)(-1);
+        }
 
-                //Output usb device plugging information
-                if(deviceinfo.info.status==1){
-                    printf("Device name: %s ====== PLUG IN \n",deviceinfo.info.name);
-                }else{
-                    printf("Device name: %s ====== PLUG OUT \n",deviceinfo.info.name);
-                }
-                printf("\n");
+        // Keep the server's sequences in step with the journal's;
+        if (server != NULL && server->Start(&loop, journal != NULL ? journal->GetNextSequence() : 1) != 0){
+            return (void *)(-1);
+        }
 
-                // Get lock;
-                ret = pthread_mutex_lock(&data_mutex);
-                if (ret != 0) {
-                    printf("Error on pthread_mutex_lock(), ret = %d\n", ret);
-                    return (void *)(-1);
-                }
+        // Latency is taken of live records only;
+        __atomic_store_n(&latencySince, MonotonicNs(), __ATOMIC_RELAXED);
 
-                // Save infomation;
-                device->AppendDatainfo(deviceinfo);
-                fifo_size = device->GetFifoSize();
+        // Records queued before the node was added raise no edge;
+        void* ret = NULL;
+        int drained = device->getBackend() != BACKEND_URING ? DrainUsbMonitor(device) : 0;
+        if (drained < 0){
+            ret = (void *)(-1);
+        }else if (drained == 0 && (loop.Run() != 0 || failed)){
+            ret = (void *)(-1);
+        }
 
-                // Unlock;
-                ret = pthread_mutex_unlock(&data_mutex);
-                if (ret != 0) {
-                    printf("Error on pthread_mutex_unlock(), ret = %d\n", ret);
-                    return (void *)(-1);
-                }
+        // Nothing held is lost, the summaries still reach the clients;
+        if (debouncer != NULL && ExpireDataInfo(device, true) != 0){
+            ret = (void *)(-1);
+        }
 
-                if (isEmpty){
-                    for (i = 0; i < isEmpty; i++){
-                        pthread_cond_signal(&fifo_nonzero);
-                    }
-                }
-                printf("Current BufferSize = %ld \n", fifo_size);
-            }
+        // Clients go before the loop they are registered on;
+        if (server != NULL){
+            server->Flush();
+            server->Stop();
         }
+        return ret;
 }
 
 
-int main(){
+/**
+ * Parse a filter given on the command line
+ *
+ * "vendor=046d,product=c52b,class=03,bus=1,hub=2,name=USB" with any subset of
+ * the fields, ids and class in hex;
+ *
+ * @param spec;
+ * @param OUT filter;
+ *
+ * @return 0 on success;
+ */
+static int ParseFilter(const char* spec, struct usb_monitor_filter_t* filter){
+    string fields = spec;
+    size_t start = 0;
+
+    memset(filter, 0, sizeof(*filter));
+    while (start < fields.size()){
+        size_t end = fields.find(',', start);
+        if (end == string::npos){
+            end = fields.size();
+        }
+        string field = fields.substr(start, end - start);
+        size_t eq = field.find('=');
+        if (eq == string::npos){
+            return -1;
+        }
+        string key = field.substr(0, eq);
+        const char* value = field.c_str() + eq + 1;
+
+        if (key == "vendor"){
+            filter->match |= USB_MONITOR_MATCH_VENDOR;
+            filter->vendor = (__u16)strtoul(value, NULL, 16);
+        }else if (key == "product"){
+            filter->match |= USB_MONITOR_MATCH_PRODUCT;
+            filter->product = (__u16)strtoul(value, NULL, 16);
+        }else if (key == "class"){
+            filter->match |= USB_MONITOR_MATCH_CLASS;
+            filter->device_class = (__u8)strtoul(value, NULL, 16);
+        }else if (key == "bus"){
+            filter->match |= USB_MONITOR_MATCH_BUS;
+            filter->busnum = (__u16)strtoul(value, NULL, 10);
+        }else if (key == "hub"){
+            filter->match |= USB_MONITOR_MATCH_HUB;
+            filter->hub_devnum = (__u8)strtoul(value, NULL, 10);
+        }else if (key == "name"){
+            filter->match |= USB_MONITOR_MATCH_NAME_PREFIX;
+            strncpy(filter->name_prefix, value, sizeof(filter->name_prefix) - 1);
+        }else{
+            return -1;
+        }
+        start = end + 1;
+    }
+    return filter->match != 0 ? 0 : -1;
+}
+
 
-    UsbMonitorDevice* monitorDevice = new UsbMonitorDevice((char*)DEV_NAME);
+/**
+ * Run CMD_STRESS and log how the producers fared, while the reader thread
+ * checks the order of what they recorded
+ *
+ * @param arg: the device;
+ */
+template <typename Device>
+static void * DoStress(void *arg){
+        Device* device = (Device*)arg;
+        struct usb_monitor_stress_t stress;
+
+        if (device->RunStress(stressEvents, stressFlags, &stress) != 0){
+            return (void *)(-1);
+        }
+        uint64_t events = stress.recorded + stress.dropped;
+        LOGI("stress %s: %u cpus, %llu recorded, %llu dropped in %.3f ms, %.1f ns per record, %llu contended \n",
+             (stress.flags & USB_MONITOR_STRESS_SERIALIZE) ? "serialized" : "per-CPU", stress.cpus,
+             (unsigned long long)stress.recorded, (unsigned long long)stress.dropped, stress.elapsed_ns / 1e6,
+             events > 0 ? (double)stress.producer_ns / events : 0.0, (unsigned long long)stress.contended);
+        return NULL;
+}
+
+/**
+ * Set up the device and run the monitor on the calling thread
+ *
+ * @param backend: BACKEND_READ, BACKEND_MMAP or BACKEND_URING;
+ * @param source: stream to read records from instead of the driver, NULL for the driver;
+ * @param consumers: threads draining the fifo, may be empty;
+ *
+ * @return 0 on success;
+ */
+template <typename Fifo>
+static int RunUsbMonitor(int backend, const char* source, const vector<void * (*)(void *)>& consumers){
+    vector<pthread_t> consumerThreads;
+    UsbMonitorDevice<Fifo>* monitorDevice = source != NULL ?
+        new UsbMonitorDevice<Fifo>((char*)source, backend, SOURCE_STREAM) :
+        new UsbMonitorDevice<Fifo>((char*)DEV_NAME, backend);
 
     if ( monitorDevice->InitSetup() != 0){
-        printf("UsbMonitorDevice::InitSetup fail \n");
+        LOGE("UsbMonitorDevice::InitSetup fail \n");
+        return -1;
+    }
+    LOGI("UsbMonitorDevice::InitSetup OK \n");
+
+    // Unwanted events are dropped in the driver, before they cost a wake up;
+    if (filters.count > 0 && monitorDevice->SetFilters(&filters) != 0){
+        return -1;
+    }
+
+    // The fifo must be sized before the consumers start;
+    monitorDevice->FifoReset(BUFFER_SIZE);
+
+    // Rebuild the fifo from the newest journaled records;
+    if (journal != NULL){
+        uint64_t replayed = journal->ReplayTail(BUFFER_SIZE, [monitorDevice](uint64_t, const UsbMonitorInfo& info){
+            monitorDevice->AppendDatainfo(info);
+        });
+        monitorDevice->DetachAllDevices();
+        fifo_size = monitorDevice->GetFifoSize();
+        LOGI("journal replayed %llu records \n", (unsigned long long)replayed);
+    }
+    for (size_t i = 0; i < consumers.size(); i++){
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, consumers[i], monitorDevice) != 0){
+            LOGE("pthread_create consumer fail \n");
+            return -1;
+        }
+        consumerThreads.push_back(thread);
+    }
+
+    pthread_t stressThread;
+    bool stress = stressEvents > 0 && pthread_create(&stressThread, NULL, DoStress<UsbMonitorDevice<Fifo> >, monitorDevice) == 0;
+
+    void* ret = DoUsbMonitor<UsbMonitorDevice<Fifo> >((void*)monitorDevice);
+
+    if (stress){
+        pthread_join(stressThread, NULL);
+    }
+
+    // Clean shutdown, the consumers must be gone before the fifo is freed;
+    if (!consumerThreads.empty()){
+        StopConsumers();
+        if constexpr (std::is_same<Fifo, BroadcastRing<UsbMonitorEvent> >::value){
+            monitorDevice->FifoShutdown();
+        }
+        for (size_t i = 0; i < consumerThreads.size(); i++){
+            pthread_join(consumerThreads[i], NULL);
+        }
+    }
+    ReportLatency();
+    UsbMonitorStats stats;
+    if (monitorDevice->GetStats(&stats) == 0){
+        LOGI("read %llu records, driver dropped %llu while running in %llu gaps (%llu since load), %llu out of order, fifo overflowed %llu, %llu not indexed \n",
+             (unsigned long long)stats.received, (unsigned long long)stats.lost, (unsigned long long)stats.gaps,
+             (unsigned long long)stats.driver.dropped, (unsigned long long)stats.reordered,
+             (unsigned long long)stats.overflowed, (unsigned long long)stats.unindexed);
+        if (monitorDevice->getSource() == SOURCE_DRIVER){
+            LOGI("driver lapped this reader by %llu records, %u unread, %u readers open \n",
+                 (unsigned long long)stats.cursor.missed, stats.cursor.unread, stats.cursor.readers);
+            LOGI("driver notifier calls = %llu, wakeups = %llu, reads = %llu (%llu empty, %llu partial), %llu bytes, polls = %llu \n",
+                 (unsigned long long)stats.counters.notifier_calls, (unsigned long long)stats.counters.wakeups,
+                 (unsigned long long)stats.counters.reads, (unsigned long long)stats.counters.empty_reads,
+                 (unsigned long long)stats.counters.partial_reads, (unsigned long long)stats.counters.bytes_copied,
+                 (unsigned long long)stats.counters.polls);
+        }
+    }
+    // Leave the driver recording everything for the next reader;
+    if (filters.count > 0 && monitorDevice->GetFilters(&filters) == 0){
+        for (__u32 i = 0; i < filters.count; i++){
+            LOGI("filter %u hits %llu \n", i, (unsigned long long)filters.filter[i].hits);
+        }
+        LOGI("filtered out %llu \n", (unsigned long long)filters.rejected);
+        memset(&filters, 0, sizeof(filters));
+        monitorDevice->SetFilters(&filters);
+    }
+    delete monitorDevice;
+
+    return ret == NULL ? 0 : -1;
+}
+
+
+int main(int argc, char* argv[]){
+
+    // "UsbMonitorApp [mmap|uring] [spsc|broadcast[=spin|yield|futex]] [journal|journal=DIR] [serve|serve=PATH]
+    //  [filter=FIELD=VALUE,...]... [debounce=MS] [source=PATH|-] [ring=N] [stress=N[,serialize]]":
+    // mmap copies records out of the shared driver ring without a syscall,
+    // uring keeps several reads in flight through io_uring, falling back to read() without it,
+    // spsc hands records to a consumer thread through the lock-free fifo,
+    // broadcast publishes them to a logger and a metrics subscriber, waiting as given,
+    // journal keeps every record on disk in JOURNAL_DIR or DIR and replays them at start,
+    // serve streams records to local clients on SERVER_SOCKET or PATH, see EventServer.h,
+    // each filter makes the driver record only matching devices, see ParseFilter,
+    // debounce coalesces the plug storms of a device within MS, see Debouncer.h;
+    // the window can be changed while running by writing it to DEBOUNCE_CONTROL and sending SIGHUP,
+    // source reads records from a FIFO or stdin instead of the driver, e.g. from UsbEventGen,
+    // and stops when the writer closes it,
+    // ring resizes the driver queue to N records, rounded up to a power of two, if it is idle,
+    // stress has the driver record N synthetic events on every CPU, serialized on one lock if asked,
+    // logs the cost per record and counts the records read out of order;
+    // SIGUSR1 logs the latency of each stage, as it is also at exit;
+    int backend = BACKEND_READ;
+    bool spsc = false;
+    bool broadcast = false;
+    const char* journalDir = NULL;
+    const char* serverPath = NULL;
+    long debounceMs = -1;
+    const char* source = NULL;
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "mmap") == 0){
+            backend = BACKEND_MMAP;
+        }else if (strcmp(argv[i], "uring") == 0){
+            backend = BACKEND_URING;
+        }else if (strcmp(argv[i], "spsc") == 0){
+            spsc = true;
+        }else if (strcmp(argv[i], "broadcast") == 0 || strcmp(argv[i], "broadcast=futex") == 0){
+            broadcast = true;
+        }else if (strcmp(argv[i], "broadcast=spin") == 0){
+            broadcast = true;
+            broadcastWait = BroadcastRing<UsbMonitorEvent>::WAIT_SPIN;
+        }else if (strcmp(argv[i], "broadcast=yield") == 0){
+            broadcast = true;
+            broadcastWait = BroadcastRing<UsbMonitorEvent>::WAIT_YIELD;
+        }else if (strcmp(argv[i], "journal") == 0){
+            journalDir = JOURNAL_DIR;
+        }else if (strncmp(argv[i], "journal=", 8) == 0){
+            journalDir = argv[i] + 8;
+        }else if (strncmp(argv[i], "filter=", 7) == 0){
+            if (filters.count == USB_MONITOR_MAX_FILTERS || ParseFilter(argv[i] + 7, &filters.filter[filters.count]) != 0){
+                printf("invalid or too many filters: %s \n", argv[i]);
+                return -1;
+            }
+            filters.count++;
+        }else if (strcmp(argv[i], "serve") == 0){
+            serverPath = SERVER_SOCKET;
+        }else if (strncmp(argv[i], "serve=", 6) == 0){
+            serverPath = argv[i] + 6;
+        }else if (strncmp(argv[i], "debounce=", 9) == 0){
+            debounceMs = strtol(argv[i] + 9, NULL, 10);
+        }else if (strncmp(argv[i], "source=", 7) == 0){
+            source = argv[i] + 7;
+        }else if (strncmp(argv[i], "ring=", 5) == 0){
+            ringSize = (uint32_t)strtoul(argv[i] + 5, NULL, 10);
+        }else if (strncmp(argv[i], "stress=", 7) == 0){
+            char* end;
+            stressEvents = (uint32_t)strtoul(argv[i] + 7, &end, 10);
+            if (strcmp(end, ",serialize") == 0){
+                stressFlags |= USB_MONITOR_STRESS_SERIALIZE;
+            }else if (*end != '\0'){
+                fprintf(stderr, "invalid stress: %s \n", argv[i]);
+                return -1;
+            }
+        }else{
+            // A misspelt option would otherwise run with the defaults;
+            fprintf(stderr, "usage: UsbMonitorApp [mmap|uring] [spsc|broadcast[=spin|yield|futex]] [journal|journal=DIR] "
+                    "[serve|serve=PATH] [filter=FIELD=VALUE,...]... [debounce=MS] [source=PATH|-] [ring=N] "
+                    "[stress=N[,serialize]] \n");
+            return -1;
+        }
+    }
+
+    // Delivered to the event loop through a signalfd, so they must be blocked
+    // before any other thread is created;
+    if (EventLoop::BlockSignals({SIGINT, SIGTERM, SIGUSR1}) != 0 ||
+        (debounceMs >= 0 && EventLoop::BlockSignals({SIGHUP}) != 0)){
+        printf("BlockSignals fail \n");
         return -1;
     }
-    printf("UsbMonitorDevice::InitSetup OK \n");
 
-    DoUsbMonitor((void*)monitorDevice);
+    // Log lines are written by a background thread from here on;
+    if (AsyncLog::Start() != 0){
+        printf("AsyncLog::Start fail \n");
+        return -1;
+    }
+
+    if (journalDir != NULL){
+        journal = new EventJournal();
+        if (journal->Open(journalDir) != 0){
+            LOGE("EventJournal::Open %s fail \n", journalDir);
+            delete journal;
+            AsyncLog::Stop();
+            return -1;
+        }
+    }
+
+    if (serverPath != NULL){
+        server = new EventServer(serverPath);
+    }
+
+    if (debounceMs >= 0){
+        debouncer = new Debouncer((int64_t)debounceMs * 1000000);
+    }
+
+    int ret;
+    if (broadcast){
+        ret = RunUsbMonitor<BroadcastRing<UsbMonitorEvent> >(backend, source, {DoEventLogger, DoEventMetrics});
+    }else if (spsc){
+        ret = RunUsbMonitor<SpscRingBuffer<UsbMonitorEvent> >(backend, source, {DoUsbConsumer});
+    }else{
+        ret = RunUsbMonitor<RingBuffer<UsbMonitorEvent, MAX_BUFFER_SIZE> >(backend, source, {});
+    }
 
-    return 0;
+    delete debouncer;
+    delete server;
+    delete journal;
+    AsyncLog::Stop();
+    return ret;
 }
@@ -0,0 +1,312 @@
+/**
+    Microbenchmarks for the fifo and the per-event decode path
+    @file UsbMonitorBench.cpp
+
+    Prints one JSON object per line, so runs can be kept and compared:
+    {"name":..., "record_bytes":..., "capacity":..., "ops":..., "ns_per_op":..., "bytes_per_op":...}
+    bytes_per_op is heap memory allocated per operation while it was timed.
+*/
+#include <chrono>
+#include <deque>
+#include <new>
+#include <string>
+#include <vector>
+#include "UsbMonitorDevice.h"
+
+static uint64_t allocatedBytes = 0;     // Counted by operator new, the benchmarks are single threaded;
+
+// Every replaceable form that allocates is counted, each freed by its matching delete;
+static void* CountedAlloc(size_t size, size_t align){
+    allocatedBytes += size;
+    void* p;
+    if (align <= __STDCPP_DEFAULT_NEW_ALIGNMENT__){
+        p = malloc(size ? size : 1);
+    }else if (posix_memalign(&p, align, size ? size : 1) != 0){
+        p = NULL;
+    }
+    if (p == NULL){
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new(size_t size) { return CountedAlloc(size, 0); }
+void* operator new[](size_t size) { return CountedAlloc(size, 0); }
+void* operator new(size_t size, std::align_val_t align) { return CountedAlloc(size, (size_t)align); }
+void* operator new[](size_t size, std::align_val_t align) { return CountedAlloc(size, (size_t)align); }
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { free(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { free(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { free(p); }
+
+// Keep the compiler from optimizing a value away;
+template <typename T>
+static inline void DoNotOptimize(const T& value){
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+template <size_t S>
+struct Record {
+    uint8_t bytes[S];
+};
+
+// The rings under test behind one surface, each evicts its oldest value when full;
+template <typename T>
+class RuntimeRing {
+public:
+    explicit RuntimeRing(size_t capacity) : mRing(capacity) {}
+    void Append(const T& val) { mRing.Append(val); }
+    void PopFront() { mRing.PopFront(); }
+    const T& Get(size_t i) const { return mRing.Get(i); }
+    size_t GetSize() const { return mRing.GetSize(); }
+private:
+    RingBuffer<T> mRing;
+};
+
+template <typename T, size_t N>
+class FixedRing {
+public:
+    explicit FixedRing(size_t) {}
+    void Append(const T& val) { mRing.Append(val); }
+    void PopFront() { mRing.PopFront(); }
+    const T& Get(size_t i) const { return mRing.Get(i); }
+    size_t GetSize() const { return mRing.GetSize(); }
+private:
+    RingBuffer<T, N> mRing;
+};
+
+template <typename T>
+class DequeRing {
+public:
+    explicit DequeRing(size_t capacity) : mCapacity(capacity) {}
+    void Append(const T& val){
+        if (mDeque.size() == mCapacity){
+            mDeque.pop_front();
+        }
+        mDeque.push_back(val);
+    }
+    void PopFront() { mDeque.pop_front(); }
+    const T& Get(size_t i) const { return mDeque[i]; }
+    size_t GetSize() const { return mDeque.size(); }
+private:
+    size_t mCapacity;
+    std::deque<T> mDeque;
+};
+
+struct BenchResult {
+    uint64_t ops;
+    double ns;
+    uint64_t bytes;
+};
+
+static double minNs = 200e6;            // Time each benchmark for at least this long;
+static const char* nameFilter = NULL;
+
+static bool Wanted(const std::string& name){
+    return nameFilter == NULL || name.find(nameFilter) != std::string::npos;
+}
+
+static void Report(const std::string& name, size_t recordBytes, size_t capacity, const BenchResult& result,
+                   const char* extra = ""){
+    printf("{\"name\":\"%s\",\"record_bytes\":%zu,\"capacity\":%zu,%s\"ops\":%llu,\"ns_per_op\":%.3f,"
+           "\"bytes_per_op\":%.3f}\n",
+           name.c_str(), recordBytes, capacity, extra, (unsigned long long)result.ops, result.ns / result.ops,
+           (double)result.bytes / result.ops);
+    fflush(stdout);
+}
+
+/**
+ * Run fn(n) with growing n until it takes minNs
+ *
+ * fn does n operations and returns the ns spent on them, so it can leave
+ * its setup untimed;
+ */
+template <typename Fn>
+static BenchResult Measure(Fn fn){
+    BenchResult result;
+    uint64_t n = 64;
+    while (1){
+        uint64_t bytes = allocatedBytes;
+        double ns = fn(n);
+        result.ops = n;
+        result.ns = ns;
+        result.bytes = allocatedBytes - bytes;
+        if (ns >= minNs || n >= (1ull << 36)){
+            return result;
+        }
+        // Aim a bit past minNs;
+        double scale = ns > 0 ? minNs * 1.2 / ns : 100;
+        n = (uint64_t)(n * (scale > 100 ? 100 : (scale < 2 ? 2 : scale)));
+    }
+}
+
+static double ElapsedNs(std::chrono::steady_clock::time_point start){
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+template <typename Ring, typename T>
+static void Fill(Ring& ring, size_t capacity){
+    T val;
+    memset(&val, 0, sizeof(val));
+    while (ring.GetSize() < capacity){
+        ring.Append(val);
+    }
+}
+
+/**
+ * Append with eviction into a full ring, PopFront and Get
+ *
+ * @param kind: name of the ring;
+ */
+template <typename Ring, size_t S>
+static void BenchRing(const char* kind, size_t capacity){
+    typedef Record<S> T;
+    std::string prefix = std::string(kind) + "/";
+
+    if (Wanted(prefix + "append_evict")){
+        Ring* ring = new Ring(capacity);
+        Fill<Ring, T>(*ring, capacity);
+        Report(prefix + "append_evict", S, capacity, Measure([&](uint64_t n){
+            T val;
+            memset(&val, 0, sizeof(val));
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for (uint64_t i = 0; i < n; i++){
+                val.bytes[0] = (uint8_t)i;
+                ring->Append(val);
+            }
+            return ElapsedNs(start);
+        }));
+        delete ring;
+    }
+
+    if (Wanted(prefix + "pop_front")){
+        Ring* ring = new Ring(capacity);
+        Report(prefix + "pop_front", S, capacity, Measure([&](uint64_t n){
+            double ns = 0;
+            for (uint64_t done = 0; done < n; ){
+                Fill<Ring, T>(*ring, capacity);
+                uint64_t run = n - done < capacity ? n - done : capacity;
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                for (uint64_t i = 0; i < run; i++){
+                    ring->PopFront();
+                }
+                ns += ElapsedNs(start);
+                done += run;
+            }
+            return ns;
+        }));
+        delete ring;
+    }
+
+    if (Wanted(prefix + "get")){
+        Ring* ring = new Ring(capacity);
+        Fill<Ring, T>(*ring, capacity);
+        Report(prefix + "get", S, capacity, Measure([&](uint64_t n){
+            uint64_t sum = 0;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for (uint64_t i = 0; i < n; i++){
+                sum += ring->Get(i & (capacity - 1)).bytes[S - 1];
+            }
+            DoNotOptimize(sum);
+            return ElapsedNs(start);
+        }));
+        delete ring;
+    }
+}
+
+template <size_t S, size_t N>
+static void BenchRings(){
+    BenchRing<RuntimeRing<Record<S> >, S>("ring_runtime", N);
+    BenchRing<FixedRing<Record<S>, N>, S>("ring_fixed", N);
+    BenchRing<DequeRing<Record<S> >, S>("deque", N);
+}
+
+template <size_t S>
+static void BenchRecordSize(){
+    BenchRings<S, 64>();
+    BenchRings<S, 1024>();
+    BenchRings<S, 16384>();
+}
+
+/**
+ * What DoUsbMonitor does per driver record once read: gap check, intern,
+ * fifo append and device index update, batches of KERNEL_BATCH_COUNT
+ *
+ * @param kind: name of the fifo;
+ * @param devices: distinct devices in the stream;
+ */
+template <typename Fifo>
+static void BenchDecode(const char* kind, uint32_t devices){
+    std::string name = std::string("decode/") + kind;
+    if (!Wanted(name)){
+        return;
+    }
+
+    std::vector<UsbMonitorInfo> records(devices > KERNEL_BATCH_COUNT ? devices : KERNEL_BATCH_COUNT);
+    for (size_t i = 0; i < records.size(); i++){
+        struct usb_message_t* info = &records[i].info;
+        uint32_t device = (uint32_t)(i % devices);
+        memset(info, 0, sizeof(*info));
+        info->plug_flag = (i / devices) % 2 == 0 ? 1 : 0;
+        info->vendor = 0x1d6b;
+        info->product = (__u16)device;
+        snprintf(info->usb_name, sizeof(info->usb_name), "bench-device-%u", device);
+        snprintf(info->serial, sizeof(info->serial), "SN%08u", device);
+    }
+
+    UsbMonitorDevice<Fifo>* device = new UsbMonitorDevice<Fifo>((char*)"bench");
+    device->FifoReset(BUFFER_SIZE);
+    uint64_t sequence = 0;
+    char extra[32];
+    snprintf(extra, sizeof(extra), "\"devices\":%u,", devices);
+
+    Report(name, sizeof(UsbMonitorInfo), BUFFER_SIZE, Measure([&](uint64_t n){
+        double ns = 0;
+        for (uint64_t done = 0; done < n; ){
+            uint64_t count = n - done < KERNEL_BATCH_COUNT ? n - done : KERNEL_BATCH_COUNT;
+            size_t first = (size_t)(done % (records.size() - count + 1));
+            for (uint64_t i = 0; i < count; i++){
+                records[first + i].info.sequence = sequence++;
+                records[first + i].info.kernel_time = (int64_t)sequence;
+            }
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            ReceiveDataInfo(device, &records[first], count);
+            ns += ElapsedNs(start);
+            done += count;
+        }
+        return ns;
+    }), extra);
+    delete device;
+}
+
+int main(int argc, char* argv[]){
+
+    // "UsbMonitorBench [min_ms=N] [filter=SUBSTRING]":
+    // min_ms is how long each benchmark runs, 200 by default,
+    // filter runs only the benchmarks whose name contains SUBSTRING;
+    for (int i = 1; i < argc; i++){
+        if (strncmp(argv[i], "min_ms=", 7) == 0){
+            minNs = strtod(argv[i] + 7, NULL) * 1e6;
+        }else if (strncmp(argv[i], "filter=", 7) == 0){
+            nameFilter = argv[i] + 7;
+        }else{
+            fprintf(stderr, "usage: UsbMonitorBench [min_ms=N] [filter=SUBSTRING] \n");
+            return -1;
+        }
+    }
+
+    BenchRecordSize<16>();
+    BenchRecordSize<sizeof(UsbMonitorEvent)>();
+    BenchRecordSize<sizeof(UsbMonitorInfo)>();
+
+    BenchDecode<RingBuffer<UsbMonitorEvent, MAX_BUFFER_SIZE> >("ringbuffer", 16);
+    BenchDecode<RingBuffer<UsbMonitorEvent, MAX_BUFFER_SIZE> >("ringbuffer", 4096);
+    BenchDecode<BroadcastRing<UsbMonitorEvent> >("broadcast", 16);
+    BenchDecode<BroadcastRing<UsbMonitorEvent> >("broadcast", 4096);
+    return 0;
+}
@@ -0,0 +1,841 @@
+#ifndef __USB_MONITOR_DEVICE_H_
+#define __USB_MONITOR_DEVICE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "BroadcastRing.h"
+#include "Debouncer.h"
+#include "DeviceIndex.h"
+#include "EventJournal.h"
+#include "EventServer.h"
+#include "IoUring.h"
+#include "LatencyHistogram.h"
+#include "Log.h"
+#include "NameTable.h"
+#include "RingBuffer.h"
+#include "SpscRingBuffer.h"
+#include "UsbInfo.h"
+
+// The reader side of the monitor, from the driver node to the fifo: the
+// device, its decode path and the state it shares with the consumers.
+// Included by UsbMonitorApp and by UsbMonitorBench, one translation unit each.
+
+static pthread_mutex_t data_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  fifo_nonzero = PTHREAD_COND_INITIALIZER;
+static volatile int64_t isEmpty = 0;   // Number of consumers sleeping on fifo_nonzero;
+static volatile int64_t fifo_size = 0;
+static EventJournal* journal = NULL;   // Written by the reader thread only, NULL when off;
+static EventServer* server = NULL;     // On the reader thread's event loop, NULL when off;
+static Debouncer* debouncer = NULL;    // Between the reader and the save path, NULL when off;
+static uint32_t ringSize = 0;                   // Driver queue size asked for before mapping, 0 keeps it;
+
+// Where the latency of a record is taken, each from its kernel_time:
+// read() returned it, it was printed, journaled and published, it is in
+// the fifo, and a consumer or subscriber took it;
+enum LatencyStage { LATENCY_READ, LATENCY_RECORD, LATENCY_APPEND, LATENCY_CONSUMER, LATENCY_LOGGER,
+                    LATENCY_METRICS, LATENCY_STAGES };
+static const char* latencyNames[LATENCY_STAGES] = {"read", "record", "append", "consumer", "logger", "metrics"};
+static LatencyHistogram latency[LATENCY_STAGES];   // Each written by one thread only;
+static int64_t latencySince = INT64_MAX;           // Older records, replayed or queued before the start, are left out;
+
+/**
+ * Fifo selects the hand-off between the reader and its consumers:
+ * RingBuffer<UsbMonitorEvent, MAX_BUFFER_SIZE> is guarded by data_mutex,
+ * SpscRingBuffer<UsbMonitorEvent> hands events to a single consumer thread without
+ * taking a lock,
+ * BroadcastRing<UsbMonitorEvent> publishes every event once to any number of
+ * subscriber threads, each reading at its own pace.
+ */
+template <typename Fifo = RingBuffer<UsbMonitorEvent, MAX_BUFFER_SIZE> >
+class UsbMonitorDevice {
+public:
+    UsbMonitorDevice(char* name, int backend = BACKEND_READ, int source = SOURCE_DRIVER){
+        mFd = -1;
+        mDev_name = name;
+        mBackend = backend;
+        mSource = source;
+        mPartial = 0;
+        mRing = NULL;
+        mRingMessages = NULL;
+        mRingBytes = 0;
+        mAppended = 0;
+        mExpected = 0;
+        memset(&mStats, 0, sizeof(mStats));
+    }
+
+    ~UsbMonitorDevice(){
+        if (mRingMessages != NULL){
+            munmap((void*)mRingMessages, mRingBytes);
+        }
+        if (mRing != NULL){
+            munmap(mRing, sysconf(_SC_PAGESIZE));
+        }
+        if (mFd != -1){
+            close(mFd);
+        }
+    }
+
+    int InitSetup(){
+        if (mSource == SOURCE_STREAM){
+            return OpenStream();
+        }
+
+        //open "/proc/usb_monitor"
+        //non-blocking, the event loop drains it until EAGAIN
+        mFd = open(mDev_name, O_RDWR | O_NONBLOCK);
+        if (mFd == -1) {
+        LOGE("open %s fail, Check!!!\n",mDev_name);
+            return errno;
+        }
+
+        if (CheckAbi() != 0){
+            return EPROTO;
+        }
+
+        // The driver keeps its queue when busy, which is not fatal;
+        if (ringSize != 0){
+            SetRingSize(ringSize);
+        }
+
+        if (mBackend == BACKEND_MMAP){
+            return MapRing();
+        }
+        if (mBackend == BACKEND_URING && SetupUring() != 0){
+            LOGW("io_uring unavailable, fall back to epoll + read \n");
+            mBackend = BACKEND_READ;
+        }
+        return 0;
+    }
+
+    // Resize the driver queue, rounded by the driver to a power of two;
+    // only while no other open file has messages left and nobody has it
+    // mapped, EBUSY otherwise; what this file had left is dropped;
+    int SetRingSize(uint32_t size){
+        if (mSource != SOURCE_DRIVER){
+            return ENOTSUP;
+        }
+        if (ioctl(mFd, CMD_SET_RING_SIZE, &size) != 0) {
+            int err = errno;
+            LOGW("ioctl CMD_SET_RING_SIZE failed, errno = %d \n", err);
+            return err;
+        }
+        LOGI("driver ring size = %u \n", size);
+        return 0;
+    }
+
+    // Have the driver record synthetic events on every CPU and wait until
+    // it is done, see CMD_STRESS; they are read like real ones meanwhile;
+    int RunStress(uint32_t events, uint32_t flags, struct usb_monitor_stress_t* stress){
+        if (mSource != SOURCE_DRIVER){
+            LOGE("stress needs the driver \n");
+            return ENOTSUP;
+        }
+        memset(stress, 0, sizeof(*stress));
+        stress->events_per_cpu = events;
+        stress->flags = flags;
+        if (ioctl(mFd, CMD_STRESS, stress) != 0) {
+            int err = errno;
+            LOGE("ioctl CMD_STRESS failed, errno = %d \n", err);
+            return err;
+        }
+        return 0;
+    }
+
+    // Install filters in the driver, count 0 removes them;
+    int SetFilters(const struct usb_monitor_filters_t* filters){
+        if (mSource != SOURCE_DRIVER){
+            LOGE("filters need the driver \n");
+            return ENOTSUP;
+        }
+        if (ioctl(mFd, CMD_SET_FILTERS, filters) != 0) {
+            LOGE("ioctl CMD_SET_FILTERS failed, errno = %d \n", errno);
+            return errno;
+        }
+        return 0;
+    }
+
+    // The installed filters with their hit counters;
+    int GetFilters(struct usb_monitor_filters_t* filters){
+        if (mSource != SOURCE_DRIVER){
+            return ENOTSUP;
+        }
+        if (ioctl(mFd, CMD_GET_FILTERS, filters) != 0) {
+            LOGE("ioctl CMD_GET_FILTERS failed, errno = %d \n", errno);
+            return errno;
+        }
+        return 0;
+    }
+
+    // Loss counters of the driver and of this run; on the reader thread, but
+    // overflowed may be added to by broadcast subscribers;
+    int GetStats(UsbMonitorStats* stats){
+        *stats = mStats;
+        stats->overflowed = __atomic_load_n(&mStats.overflowed, __ATOMIC_RELAXED);
+        if (mSource != SOURCE_DRIVER){
+            memset(&stats->driver, 0, sizeof(stats->driver));
+            memset(&stats->counters, 0, sizeof(stats->counters));
+            memset(&stats->cursor, 0, sizeof(stats->cursor));
+            return 0;
+        }
+        if (ioctl(mFd, CMD_GET_STATS, &stats->driver) != 0) {
+            LOGE("ioctl CMD_GET_STATS failed, errno = %d \n", errno);
+            return errno;
+        }
+        if (ioctl(mFd, CMD_GET_COUNTERS, &stats->counters) != 0) {
+            LOGE("ioctl CMD_GET_COUNTERS failed, errno = %d \n", errno);
+            return errno;
+        }
+        if (ioctl(mFd, CMD_GET_CURSOR, &stats->cursor) != 0) {
+            LOGE("ioctl CMD_GET_CURSOR failed, errno = %d \n", errno);
+            return errno;
+        }
+        return 0;
+    }
+
+    // Check a batch read from the driver against the sequence expected next;
+    // a jump forward is the number of events the driver dropped in between;
+    void CheckSequence(const UsbMonitorInfo* info, size_t count){
+        for (size_t i = 0; i < count; i++){
+            uint64_t sequence = info[i].info.sequence;
+            if (mStats.received > 0 && sequence != mExpected){
+                if (sequence > mExpected){
+                    mStats.gaps++;
+                    mStats.lost += sequence - mExpected;
+                    LOGW("driver dropped %llu events before sequence %llu \n",
+                         (unsigned long long)(sequence - mExpected), (unsigned long long)sequence);
+                }else{
+                    // The module was reloaded, or the driver broke its order;
+                    mStats.reordered++;
+                    LOGW("driver sequence went back from %llu to %llu \n",
+                         (unsigned long long)mExpected, (unsigned long long)sequence);
+                }
+            }
+            mExpected = sequence + 1;
+            mStats.received++;
+        }
+    }
+
+    // Events a broadcast subscriber was lapped on, from its thread;
+    void CountOverflowed(uint64_t count){
+        __atomic_add_fetch(&mStats.overflowed, count, __ATOMIC_RELAXED);
+    }
+
+    int getBackend() { return mBackend; };
+
+    int getSource() { return mSource; };
+
+    int getFd() { return mFd; };
+    char* getBuffer() { return mBuf; };
+
+    // A stream may end a read inside a record, its first bytes are kept at
+    // the start of the buffer for the next read;
+    size_t getPartial() { return mPartial; };
+    void setPartial(size_t partial) { mPartial = partial; };
+
+    // Number of messages waiting in the shared ring, more than it holds once
+    // the driver has lapped this reader;
+    uint32_t GetPendingCount(){
+        uint32_t write = __atomic_load_n(&mRing->usb_message_index_write, __ATOMIC_ACQUIRE);
+        return write - mRing->usb_message_index_read;
+    }
+
+    // Copy out the oldest unread messages of the shared ring, at most
+    // KERNEL_BATCH_COUNT, and hand their slots back to the driver;
+    // the driver overwrites the oldest message when the ring is full, so
+    // a reader that fell a whole ring behind skips to the oldest one left,
+    // and copied slots the driver claimed meanwhile are dropped again.
+    // Either shows as a gap in the sequence numbers;
+    const UsbMonitorInfo* CopyMessages(uint32_t* count){
+        uint32_t size = mRing->message_buffer_size;
+        uint32_t write = __atomic_load_n(&mRing->usb_message_index_write, __ATOMIC_ACQUIRE);
+        uint32_t read = mRing->usb_message_index_read;
+        if (write - read > size){
+            read = write - size;
+        }
+
+        uint32_t n = write - read < KERNEL_BATCH_COUNT ? write - read : KERNEL_BATCH_COUNT;
+        const UsbMonitorInfo* ring = mRingMessages;
+        UsbMonitorInfo* out = (UsbMonitorInfo*)mBuf;
+        uint32_t index = read & (size - 1);
+        uint32_t first = size - index < n ? size - index : n;
+        memcpy(out, ring + index, first * sizeof(UsbMonitorInfo));
+        memcpy(out + first, ring, (n - first) * sizeof(UsbMonitorInfo));
+
+        // Slot i is whole only if the driver had not claimed it for a newer
+        // message by the end of the copy;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        uint32_t claim = __atomic_load_n(&mRing->usb_message_index_claim, __ATOMIC_RELAXED);
+        uint32_t skip = 0;
+        if (claim - read > size){
+            skip = claim - read - size < n ? claim - read - size : n;
+        }
+
+        __atomic_store_n(&mRing->usb_message_index_read, read + n, __ATOMIC_RELEASE);
+        *count = n - skip;
+        return out + skip;
+    }
+
+#ifdef USB_MONITOR_HAVE_IO_URING
+    IoUring* getUring() { return &mUring; };
+    char* getUringBuffer(unsigned i) { return mUringBuf[i]; };
+
+    // Queue a read into registered buffer i, sent by the next mUring.Submit;
+    bool QueueUringRead(unsigned i){
+        return mUring.PrepReadFixed(mFd, mUringBuf[i], KERNEL_DATA_LENG, i, i);
+    }
+#endif
+
+    UsbMonitorEvent& GetFristDataInfo(){
+        return mRingBuffer.Front();
+    }
+    void PPopFrontDatainfo(){
+        mRingBuffer.PopFront();
+    }
+
+    void PopBackDatainfo(){
+        if (!mRingBuffer.IsEmpty()){
+            mAppended--;
+        }
+        mRingBuffer.PopBack();
+    }
+
+    UsbMonitorEvent& GetBackDataInfo(){
+        return mRingBuffer.Back();
+    }
+
+    void AppendDatainfo(const UsbMonitorInfo& info){
+        UsbMonitorEvent event;
+        // A full RingBuffer evicts its oldest event, a full SpscRingBuffer rejects this one;
+        if (mRingBuffer.GetSize() == mRingBuffer.GetCapacity()){
+            mStats.overflowed++;
+        }
+        // Rejected events stay out of the device index too;
+        const UsbMonitorEvent* put = PutEvent(mRingBuffer, info, &event);
+        if (put != NULL){
+            IndexEvent(*put);
+        }
+    }
+
+    // SpscRingBuffer and BroadcastRing, the fifos with AppendBatch; returns
+    // the events saved, a full SpscRingBuffer rejects the rest;
+    size_t AppendDatainfoBatch(const UsbMonitorInfo* info, size_t count){
+        UsbMonitorEvent events[KERNEL_BATCH_COUNT];
+        size_t saved = 0;
+
+        while (saved < count){
+            size_t n = count - saved < KERNEL_BATCH_COUNT ? count - saved : KERNEL_BATCH_COUNT;
+            for (size_t i = 0; i < n; i++){
+                MakeEvent(info[saved + i], &events[i]);
+            }
+            // Rejected events stay out of the device index too;
+            size_t appended = mRingBuffer.AppendBatch(events, n);
+            for (size_t i = 0; i < appended; i++){
+                IndexEvent(events[i]);
+            }
+            saved += appended;
+            if (appended < n){
+                break;
+            }
+        }
+        mStats.overflowed += count - saved;
+        return saved;
+    }
+
+    // Name of an event, from any thread;
+    const char* GetName(uint32_t name_id){
+        return mNames.GetName(name_id);
+    }
+
+    // Serial number of an event, from any thread;
+    const char* GetSerial(uint32_t serial_id){
+        return mSerials.GetName(serial_id);
+    }
+
+    // Device lookups, on the thread appending only; a device without a
+    // serial number is also known by vendor, product and bus;
+    const DeviceIndex::DeviceState* FindDevice(const char* name, const char* serial, uint16_t vendor = 0,
+                                               uint16_t product = 0, uint16_t busnum = 0){
+        uint32_t name_id = mNames.Find(name);
+        uint32_t serial_id = mSerials.Find(serial);
+        if (name_id == NameTable::NONE || serial_id == NameTable::NONE){
+            return NULL;
+        }
+        return mDevices.Find(name_id, serial_id, serial[0] == '\0' ? DeviceIndex::Model(vendor, product, busnum) : 0);
+    }
+
+    template <typename Fn>
+    void ForEachAttachedDevice(Fn fn){
+        mDevices.ForEachAttached(fn);
+    }
+
+    size_t GetAttachedCount(){
+        return mDevices.GetAttachedCount();
+    }
+
+    // Events replayed from an earlier run say nothing of what is plugged in now;
+    void DetachAllDevices(){
+        mDevices.DetachAll();
+    }
+
+    // Latest event of the device while the fifo still holds it, else NULL;
+    // RingBuffer only, under data_mutex;
+    const UsbMonitorEvent* GetLatestDataInfo(const DeviceIndex::DeviceState* state){
+        uint64_t first = mAppended - mRingBuffer.GetSize();
+        if (state == NULL || state->position < first || state->position >= mAppended){
+            return NULL;
+        }
+
+        // PopBackDatainfo may have handed the position to another event;
+        const UsbMonitorEvent& event = mRingBuffer.Get(state->position - first);
+        int64_t time = state->attached ? state->plug_in_time : state->plug_out_time;
+        if (event.kernel_time != time || event.name_id != state->name_id || event.serial_id != state->serial_id){
+            return NULL;
+        }
+        return &event;
+    }
+
+    size_t PopFrontDatainfoBatch(UsbMonitorEvent* event, size_t count){
+        return mRingBuffer.PopFrontBatch(event, count);
+    }
+
+    // BroadcastRing only;
+    template <typename WaitStrategy>
+    int FifoSubscribe(WaitStrategy wait){
+        return mRingBuffer.Subscribe(wait);
+    }
+
+    size_t TakeDatainfoBatch(int subscriber, UsbMonitorEvent* event, size_t count, uint64_t* lost){
+        return mRingBuffer.Take(subscriber, event, count, lost);
+    }
+
+    void FifoShutdown(){
+        mRingBuffer.Shutdown();
+    }
+
+    size_t GetFifoSize(){
+        return mRingBuffer.GetSize();
+    }
+
+    void FifoReset(size_t capacity) {
+        mRingBuffer.Reset(capacity);
+    }
+
+    bool FifoIsEmpty() {
+        return mRingBuffer.IsEmpty();
+    }
+
+private:
+    void MakeEvent(const UsbMonitorInfo& info, UsbMonitorEvent* event){
+        event->kernel_time = info.info.kernel_time;
+        event->name_id = mNames.Intern(info.info.usb_name);
+        event->serial_id = mSerials.Intern(info.info.serial);
+        event->sequence = (uint32_t)info.info.sequence;
+        event->vendor = info.info.vendor;
+        event->product = info.info.product;
+        event->busnum = info.info.busnum;
+        event->devnum = info.info.devnum;
+        event->speed = info.info.speed;
+        event->plug_flag = info.info.plug_flag;
+        event->device_class = info.info.device_class;
+        event->flaps = info.info.flaps;
+    }
+
+    // Make the event of info and put it in the fifo; returns the event as
+    // stored, NULL when the fifo turned it away. A RingBuffer builds it in
+    // its slot and always takes it;
+    template <size_t N>
+    const UsbMonitorEvent* PutEvent(RingBuffer<UsbMonitorEvent, N>& fifo, const UsbMonitorInfo& info,
+                                    UsbMonitorEvent*){
+        UsbMonitorEvent& event = fifo.Emplace();
+        MakeEvent(info, &event);
+        return &event;
+    }
+
+    // The others copy event in, only a full SpscRingBuffer rejects it;
+    const UsbMonitorEvent* PutEvent(SpscRingBuffer<UsbMonitorEvent>& fifo, const UsbMonitorInfo& info,
+                                    UsbMonitorEvent* event){
+        MakeEvent(info, event);
+        return fifo.Append(*event) ? event : NULL;
+    }
+
+    const UsbMonitorEvent* PutEvent(BroadcastRing<UsbMonitorEvent>& fifo, const UsbMonitorInfo& info,
+                                    UsbMonitorEvent* event){
+        MakeEvent(info, event);
+        fifo.Append(*event);
+        return event;
+    }
+
+    // After the event went into the fifo;
+    void IndexEvent(const UsbMonitorEvent& event){
+        if (event.name_id != NameTable::NONE && event.serial_id != NameTable::NONE){
+            // Without a serial number the model stands in for it;
+            uint64_t model = mSerials.GetName(event.serial_id)[0] == '\0' ?
+                             DeviceIndex::Model(event.vendor, event.product, event.busnum) : 0;
+            mDevices.Update(event, model, mAppended);
+        }else if (mStats.unindexed++ == 0){
+            LOGE("name table full, %u names and %u serials, events of new devices are not indexed \n",
+                 mNames.GetCount(), mSerials.GetCount());
+        }
+        mAppended++;
+    }
+
+    // Make sure the driver speaks the record layout we were built against;
+    int CheckAbi(){
+        struct usb_monitor_abi_t abi;
+        memset(&abi, 0, sizeof(abi));
+        abi.version = USB_MONITOR_ABI_VERSION;
+        abi.message_size = sizeof(struct usb_message_t);
+        if (ioctl(mFd, CMD_GET_ABI, &abi) != 0) {
+            LOGE("abi mismatch: driver version = %u message size = %u, app version = %u message size = %lu, errno = %d \n",
+                abi.version, abi.message_size, USB_MONITOR_ABI_VERSION, sizeof(struct usb_message_t), errno);
+            return -1;
+        }
+        return 0;
+    }
+
+    // Records arrive on a pipe, FIFO or socket, "-" is stdin;
+    int OpenStream(){
+        if (strcmp(mDev_name, "-") == 0){
+            mFd = dup(STDIN_FILENO);
+        }else{
+            // Blocks until a writer opens a FIFO, so EOF only comes when it is done;
+            mFd = open(mDev_name, O_RDONLY);
+        }
+        if (mFd == -1 || fcntl(mFd, F_SETFL, fcntl(mFd, F_GETFL) | O_NONBLOCK) != 0) {
+            LOGE("open %s fail, errno = %d \n", mDev_name, errno);
+            return errno;
+        }
+        if (mBackend != BACKEND_READ){
+            LOGW("a stream is only read(), backend ignored \n");
+            mBackend = BACKEND_READ;
+        }
+        return 0;
+    }
+
+    // Keep URING_DEPTH reads on the node in flight, one per registered buffer;
+    int SetupUring(){
+#ifdef USB_MONITOR_HAVE_IO_URING
+        struct iovec iov[URING_DEPTH];
+        int ret = mUring.InitSetup(URING_DEPTH * 2);
+        if (ret != 0) {
+            LOGE("io_uring_setup failed, errno = %d \n", ret);
+            return ret;
+        }
+
+        for (unsigned i = 0; i < URING_DEPTH; i++){
+            iov[i].iov_base = mUringBuf[i];
+            iov[i].iov_len = KERNEL_DATA_LENG;
+        }
+        ret = mUring.RegisterBuffers(iov, URING_DEPTH);
+        if (ret != 0) {
+            LOGE("io_uring_register failed, errno = %d \n", ret);
+            return ret;
+        }
+
+        // io_uring honours O_NONBLOCK and would complete every read on an idle
+        // node at once with EAGAIN; without it the reads wait for data in the
+        // kernel. Nothing else reads mFd in this backend;
+        int flags = fcntl(mFd, F_GETFL);
+        if (flags == -1 || fcntl(mFd, F_SETFL, flags & ~O_NONBLOCK) != 0) {
+            ret = errno;
+            LOGE("fcntl %s failed, errno = %d \n", mDev_name, ret);
+            return ret;
+        }
+
+        for (unsigned i = 0; i < URING_DEPTH; i++){
+            QueueUringRead(i);
+        }
+        ret = mUring.Submit(0);
+        if (ret != 0) {
+            // Back to the epoll + read fallback, which needs it;
+            fcntl(mFd, F_SETFL, flags);
+        }
+        return ret;
+#else
+        return ENOSYS;
+#endif
+    }
+
+    int MapRing(){
+        // The header page, writable for the read address, tells the size of
+        // the messages, which the driver only lets us map read only;
+        size_t page = sysconf(_SC_PAGESIZE);
+        void* header = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, 0);
+        if (header == MAP_FAILED) {
+            LOGE("mmap %s failed, errno = %d \n", mDev_name, errno);
+            return errno;
+        }
+        mRing = (struct usb_monitor_ring_t*)header;
+        if (mRing->message_size != KERNEL_MESSAGE_SIZE) {
+            LOGE("unexpected message size %u \n", mRing->message_size);
+            return EINVAL;
+        }
+
+        mRingBytes = (size_t)mRing->message_buffer_size * KERNEL_MESSAGE_SIZE;
+        void* addr = mmap(NULL, mRingBytes, PROT_READ, MAP_SHARED, mFd, mRing->message_offset);
+        if (addr == MAP_FAILED) {
+            LOGE("mmap %s failed, errno = %d \n", mDev_name, errno);
+            return errno;
+        }
+        mRingMessages = (const UsbMonitorInfo*)addr;
+        LOGI("mmap ok ring size = %u \n", mRing->message_buffer_size);
+        return 0;
+    }
+
+    int mFd; //"/proc/usb_monitor"
+    char *mDev_name;
+    char mBuf[KERNEL_DATA_LENG];
+    int mBackend;
+    int mSource;
+    size_t mPartial; //bytes of an incomplete record at the start of mBuf, SOURCE_STREAM only
+    struct usb_monitor_ring_t* mRing; //shared with the driver in BACKEND_MMAP
+    const UsbMonitorInfo* mRingMessages; //read only, after the header
+    size_t mRingBytes; //of mRingMessages
+#ifdef USB_MONITOR_HAVE_IO_URING
+    IoUring mUring; //BACKEND_URING
+    char mUringBuf[URING_DEPTH][KERNEL_DATA_LENG];
+#endif
+    Fifo mRingBuffer;
+    NameTable mNames; //usb_name of the events in mRingBuffer
+    NameTable mSerials; //serial of the events in mRingBuffer
+    DeviceIndex mDevices; //state of every device, updated as records are appended
+    uint64_t mAppended; //position of the next record appended
+    uint64_t mExpected; //driver sequence of the next record read
+    UsbMonitorStats mStats; //loss counters, driver ones filled in by GetStats
+};
+
+/**
+ * Output one usb device plugging record
+ *
+ * @param deviceinfo;
+ */
+static inline void PrintDataInfo(const UsbMonitorInfo& deviceinfo){
+        const struct usb_message_t* info = &deviceinfo.info;
+
+        //Output usb device plugging information
+        //Compiled out unless USB_MONITOR_LOG_LEVEL is LOG_LEVEL_DEBUG;
+        LOGD("kernel_time = %lld Device name: %s %04x:%04x bus %u dev %u speed %u serial %s flaps %u ====== %s \n",
+             (long long)info->kernel_time, info->usb_name, info->vendor, info->product, info->busnum,
+             info->devnum, info->speed, info->serial, info->flaps, info->plug_flag == 1 ? "PLUG IN" : "PLUG OUT");
+}
+
+static inline int64_t MonotonicNs(){
+        // kernel_time is CLOCK_MONOTONIC;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static inline int64_t KernelTime(const UsbMonitorInfo& deviceinfo) { return deviceinfo.info.kernel_time; }
+static inline int64_t KernelTime(const UsbMonitorEvent& event) { return event.kernel_time; }
+
+/**
+ * Add the age of a batch of records at a stage to its histogram
+ *
+ * One clock read per batch;
+ *
+ * @param stage: LatencyStage, written by the calling thread only;
+ * @param records: UsbMonitorInfo or UsbMonitorEvent;
+ * @param count: number of records;
+ */
+template <typename Record>
+static void RecordLatency(int stage, const Record* records, size_t count){
+        int64_t now = MonotonicNs();
+        int64_t since = __atomic_load_n(&latencySince, __ATOMIC_RELAXED);
+        for (size_t i = 0; i < count; i++){
+            int64_t time = KernelTime(records[i]);
+            if (time >= since && time <= now){
+                latency[stage].Record((uint64_t)(now - time));
+            }
+        }
+}
+
+/**
+ * Log p50/p99/p99.9/max of every stage that saw a record
+ */
+static inline void ReportLatency(){
+        for (int i = 0; i < LATENCY_STAGES; i++){
+            const LatencyHistogram& histogram = latency[i];
+            if (histogram.GetCount() == 0){
+                continue;
+            }
+            LOGI("latency %-8s count %llu p50 %.1f us p99 %.1f us p99.9 %.1f us max %.1f us \n", latencyNames[i],
+                 (unsigned long long)histogram.GetCount(), histogram.GetPercentile(0.5) / 1e3,
+                 histogram.GetPercentile(0.99) / 1e3, histogram.GetPercentile(0.999) / 1e3,
+                 histogram.GetMax() / 1e3);
+        }
+}
+
+/**
+ * Print and journal a batch of records before it goes into the fifo
+ *
+ * @param deviceinfo: decoded records;
+ * @param count: number of records;
+ */
+static inline void RecordDataInfo(const UsbMonitorInfo* deviceinfo, ssize_t count){
+        for (ssize_t i = 0; i < count; i++){
+            PrintDataInfo(deviceinfo[i]);
+        }
+
+        // Stores into the mapped segment only;
+        if (journal != NULL && journal->Append(deviceinfo, count) != 0){
+            LOGE("journal append failed, journaling stopped \n");
+            delete journal;
+            journal = NULL;
+        }
+
+        // Sent to the clients once the whole drain is saved;
+        if (server != NULL){
+            server->Publish(deviceinfo, count);
+        }
+        RecordLatency(LATENCY_RECORD, deviceinfo, count);
+}
+
+/**
+ * Save a batch of records and wake up the waiting consumers
+ *
+ * @param device;
+ * @param deviceinfo: decoded records;
+ * @param count: number of records;
+ *
+ * @return 0 on success;
+ */
+template <typename Device>
+static int SaveDataInfo(Device* device, const UsbMonitorInfo* deviceinfo, ssize_t count){
+        int ret;
+        ssize_t i = 0;
+
+        RecordDataInfo(deviceinfo, count);
+
+        // Get lock;
+        ret = pthread_mutex_lock(&data_mutex);
+        if (ret != 0) {
+            LOGE("Error on pthread_mutex_lock(), ret = %d\n", ret);
+            return -1;
+        }
+
+        // Save infomation;
+        // The whole batch is appended under one lock;
+        for (i = 0; i < count; i++){
+            device->AppendDatainfo(deviceinfo[i]);
+        }
+        fifo_size = device->GetFifoSize();
+
+        // Unlock;
+        ret = pthread_mutex_unlock(&data_mutex);
+        if (ret != 0) {
+            LOGE("Error on pthread_mutex_unlock(), ret = %d\n", ret);
+            return -1;
+        }
+        RecordLatency(LATENCY_APPEND, deviceinfo, count);
+
+        if (isEmpty){
+            for (i = 0; i < isEmpty; i++){
+                pthread_cond_signal(&fifo_nonzero);
+            }
+        }
+        LOGD("Current BufferSize = %ld \n", fifo_size);
+        return 0;
+}
+
+/**
+ * Save a batch of records into the lock-free fifo
+ *
+ * Only takes data_mutex when the consumer thread is asleep;
+ *
+ * @param device;
+ * @param deviceinfo: decoded records;
+ * @param count: number of records;
+ *
+ * @return 0 on success;
+ */
+static inline int SaveDataInfo(UsbMonitorDevice<SpscRingBuffer<UsbMonitorEvent> >* device,
+                        const UsbMonitorInfo* deviceinfo, ssize_t count){
+        RecordDataInfo(deviceinfo, count);
+
+        size_t saved = device->AppendDatainfoBatch(deviceinfo, count);
+        RecordLatency(LATENCY_APPEND, deviceinfo, saved);
+        if (saved < (size_t)count){
+            LOGW("Fifo is full, drop %ld records \n", count - saved);
+        }
+        fifo_size = device->GetFifoSize();
+
+        // Pairs with the fence in DoUsbConsumer, either it sees the new records
+        // or we see it waiting;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&isEmpty, __ATOMIC_RELAXED)){
+            pthread_mutex_lock(&data_mutex);
+            pthread_cond_signal(&fifo_nonzero);
+            pthread_mutex_unlock(&data_mutex);
+        }
+        LOGD("Current BufferSize = %ld \n", fifo_size);
+        return 0;
+}
+
+/**
+ * Publish a batch of records to every subscriber
+ *
+ * Never blocks and never takes a lock, sleeping subscribers are woken by
+ * the ring;
+ *
+ * @param device;
+ * @param deviceinfo: decoded records;
+ * @param count: number of records;
+ *
+ * @return 0 on success;
+ */
+static inline int SaveDataInfo(UsbMonitorDevice<BroadcastRing<UsbMonitorEvent> >* device,
+                        const UsbMonitorInfo* deviceinfo, ssize_t count){
+        RecordDataInfo(deviceinfo, count);
+
+        device->AppendDatainfoBatch(deviceinfo, count);
+        RecordLatency(LATENCY_APPEND, deviceinfo, count);
+        fifo_size = device->GetFifoSize();
+        LOGD("Current BufferSize = %ld \n", fifo_size);
+        return 0;
+}
+
+/**
+ * Check a batch read from the driver and save what the debouncer lets through
+ *
+ * Runs of passed records are saved in place, held ones are copied into the
+ * debouncer;
+ *
+ * @param device;
+ * @param deviceinfo: records as read;
+ * @param count: number of records;
+ *
+ * @return 0 on success;
+ */
+template <typename Device>
+static int ReceiveDataInfo(Device* device, const UsbMonitorInfo* deviceinfo, ssize_t count){
+        RecordLatency(LATENCY_READ, deviceinfo, count);
+        device->CheckSequence(deviceinfo, count);
+        if (debouncer == NULL){
+            return SaveDataInfo(device, deviceinfo, count);
+        }
+
+        ssize_t start = 0;
+        for (ssize_t i = 0; i < count; i++){
+            if (debouncer->Push(deviceinfo[i])){
+                continue;
+            }
+            if (i > start && SaveDataInfo(device, deviceinfo + start, i - start) != 0){
+                return -1;
+            }
+            start = i + 1;
+        }
+        return count > start ? SaveDataInfo(device, deviceinfo + start, count - start) : 0;
+}
+
+#endif
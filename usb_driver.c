@@ -19,103 +19,678 @@
 #include <linux/ktime.h>
 #include <linux/time.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/rcupdate.h>
+#include <linux/atomic.h>
+#include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/sched.h>
+#include <linux/capability.h>
+#include <linux/list.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/string.h>
 #include <linux/version.h>
 
+#include "usb_monitor_abi.h"
+
 
 #define LOGI(...)	(pr_info(__VA_ARGS__))
 #define LOGE(...)	(pr_err(__VA_ARGS__))
 
 
-#define MESSAGE_BUFFER_SIZE	512
-#define CMD_GET_STATUS	_IOR(0xFF, 123, unsigned char)
+#define MESSAGE_BUFFER_SIZE	512    // Default ring_size;
+#define CPU_BUFFER_SIZE		128    // Messages staged per CPU, must be a power of two;
+#define CPU_BUFFER_MASK		(CPU_BUFFER_SIZE - 1)
+#define INFLIGHT_NONE		U64_MAX
+#define STRESS_MAX_EVENTS	(1 << 24)   // Per CPU;
 
 
 #define OUT
 #define IN
 
 
-struct usb_message_t {
-    signed long long kernel_time;   // 8 bytes;
-    char             plug_flag;     // 1 means insert usb,0 means unplug usb;
-    char             usb_name[32];
+/*
+ * Staging buffer of one CPU. The producer runs with preemption off, so each
+ * buffer has a single writer and its sequence numbers only grow; the drain
+ * is its single reader. inflight is the sequence number being recorded, or
+ * a lower bound before it is known, INFLIGHT_NONE between events, see
+ * usb_monitor_drain; an atomic64_t, so its acquire and release accesses are
+ * single accesses on 32-bit kernels too.
+ */
+struct usb_monitor_cpu_t {
+    struct usb_message_t *message;      // CPU_BUFFER_SIZE messages, on the CPU's node;
+    __u32  head;                        // Written by the producer, published with a release store;
+    __u32  tail;                        // Written by the drain, frees slots with a release store;
+    atomic64_t inflight;
+    __u64  recorded;                    // Written by the producer only;
+    __u64  dropped;                     // Buffer full, written by the producer only;
+} ____cacheline_aligned;
+
+
+/*
+ * Filters as installed, replaced as a whole under RCU so the producers read
+ * them without a lock. Hits are counted per CPU, the rejected count after
+ * the hits of the USB_MONITOR_MAX_FILTERS filters.
+ */
+struct usb_monitor_filter_set_t {
+    struct usb_monitor_filters_t filters;   // Counters unused;
+    __u64 __percpu *hits;
+};
+
+
+/*
+ * One open file of /proc/usb_monitor, its private data. Every reader gets
+ * the whole stream at its own pace; one that falls a whole queue behind is
+ * lapped, moved on to the oldest message still there, and the messages it
+ * skipped are added to missed. Under usb_monitor_mutex, cursor is read
+ * without it by poll() and the wait condition.
+ */
+struct usb_monitor_reader_t {
+    struct list_head node;              // In usb_monitor_t.readers;
+    __u32  cursor;                      // Next message to read, same scale as the write address;
+    __u64  missed;                      // Messages lost to lapping since open;
+    atomic_t mapped;                    // Live mmap areas of this file, each dropped by its vm close;
+    int    via_header;                  // Consumes the queue through the header since mmap(), see usb_monitor_sync;
 };
 
 
 struct usb_monitor_t {
     struct notifier_block fb_notif;
-    struct usb_message_t message[MESSAGE_BUFFER_SIZE];
-    int    usb_message_count;      // Number of recorded data;
-    int    usb_message_index_read; // Read adress;
-    int    usb_message_index_write;// Write adress;
+    struct usb_monitor_ring_t *ring;    // Header page followed by the messages, vmalloc_user, RCU;
+    struct usb_message_t *message;
+    size_t ring_bytes;                  // Size of the mapping;
+    __u32  ring_size;                   // Messages in the queue, a power of two;
+    __u32  ring_mask;                   // ring_size - 1;
+    atomic_t mappings;                  // Live mmap areas of the ring, it cannot be replaced while any;
+    struct usb_monitor_reader_t *mapper; // The one file the areas belong to while any, under usb_monitor_ring_mutex;
+    __u32  usb_message_index_write;     // Private write adress, never read back from user space;
+    __u32  ring_filled;                 // Messages held by the queue, up to ring_size, a new reader starts at the oldest;
+    struct list_head readers;           // Open files, under usb_monitor_mutex;
     int    enable_usb_monitor;
     char   write_buff[10];
     char*  init_flag;
 
     wait_queue_head_t usb_monitor_queue;           // Define wait queue head;
-    struct            mutex usb_monitor_mutex;     // Mutex;
+    struct            mutex usb_monitor_mutex;     // Serializes readers, the drain and configuration, never taken by producers;
+    struct            mutex usb_monitor_ring_mutex; // mmap() against a resize, never held across a user copy;
+    spinlock_t        usb_monitor_producer_lock;   // Only taken by CMD_STRESS with USB_MONITOR_STRESS_SERIALIZE;
+
+    struct usb_monitor_cpu_t __percpu *cpus;       // Producers write here, usb_monitor_drain moves it to the ring;
+    struct work_struct drain_work;                 // Drains filling buffers when no reader does;
+    struct usb_monitor_filter_set_t *filter_set;   // RCU, NULL records everything;
+    atomic64_t sequence;                           // Next sequence number;
+    atomic_t   stress_running;
 };
 
 
 static struct usb_monitor_t *monitor;
 static char *TAG = "MONITOR";
 
+static unsigned int ring_size = MESSAGE_BUFFER_SIZE;
+module_param(ring_size, uint, 0444);
+MODULE_PARM_DESC(ring_size, "Messages in the queue, rounded up to a power of two (default 512)");
+
+// Hot path counters, summed over the CPUs when read;
+static DEFINE_PER_CPU(struct usb_monitor_counters_t, usb_monitor_counters);
+
+#define COUNT(field)		this_cpu_inc(usb_monitor_counters.field)
+#define COUNT_ADD(field, n)	this_cpu_add(usb_monitor_counters.field, (n))
+
+
+/**
+ * Sum the per-CPU counters;
+ *
+ * Each CPU's counters only grow, so the sum may miss increments in flight
+ * but never goes back;
+ *
+ * @param OUT counters;
+ */
+static void usb_monitor_sum_counters(struct usb_monitor_counters_t *counters){
+    int cpu;
+
+    memset(counters, 0, sizeof(*counters));
+    for_each_possible_cpu(cpu) {
+        struct usb_monitor_counters_t *c = per_cpu_ptr(&usb_monitor_counters, cpu);
+
+        counters->notifier_calls += READ_ONCE(c->notifier_calls);
+        counters->wakeups += READ_ONCE(c->wakeups);
+        counters->reads += READ_ONCE(c->reads);
+        counters->empty_reads += READ_ONCE(c->empty_reads);
+        counters->partial_reads += READ_ONCE(c->partial_reads);
+        counters->bytes_copied += READ_ONCE(c->bytes_copied);
+        counters->polls += READ_ONCE(c->polls);
+        counters->ioctls += READ_ONCE(c->ioctls);
+    }
+}
+
+
+/**
+ * Number of recorded data in the circular queue unread through the mapping;
+ *
+ * The read address may be written by user space through the mapping, so it is
+ * never trusted beyond the private write address. A reader lapped by
+ * the queue has the whole queue to read.
+ *
+ * @return count of unread messages;
+ */
+static __u32 usb_monitor_pending(void){
+    __u32 read, count;
+
+    // The ring may be replaced by CMD_SET_RING_SIZE, only while empty;
+    rcu_read_lock();
+    read = READ_ONCE(rcu_dereference(monitor->ring)->usb_message_index_read);
+    rcu_read_unlock();
+    count = READ_ONCE(monitor->usb_message_index_write) - read;
+
+    return min_t(__u32, count, READ_ONCE(monitor->ring_filled));
+}
+
+
+/**
+ * Number of messages in the circular queue a reader has not read yet;
+ *
+ * Counts a lapped reader as having the whole queue to read, see
+ * usb_monitor_catch_up;
+ *
+ * @param reader;
+ *
+ * @return count of unread messages;
+ */
+static __u32 usb_monitor_unread(struct usb_monitor_reader_t *reader){
+    __u32 count = READ_ONCE(monitor->usb_message_index_write) - READ_ONCE(reader->cursor);
+
+    return min_t(__u32, count, READ_ONCE(monitor->ring_filled));
+}
+
+
+/**
+ * Move a lapped reader on to the oldest message still in the queue and
+ * count what it missed;
+ *
+ * Called with usb_monitor_mutex held.
+ *
+ * @param reader;
+ */
+static void usb_monitor_catch_up(struct usb_monitor_reader_t *reader){
+    __u32 behind = monitor->usb_message_index_write - reader->cursor;
+
+    if (behind > monitor->ring_filled) {
+        reader->missed += behind - monitor->ring_filled;
+        WRITE_ONCE(reader->cursor, monitor->usb_message_index_write - monitor->ring_filled);
+    }
+}
+
+
+/**
+ * Hand the position of a reader back to its cursor once its mappings are gone
+ *
+ * A reader of the mapping moves the read address in the header instead of
+ * its cursor. When its last area is unmapped the cursor goes on from there,
+ * so read() continues where the mapping left off. Not done by the vm close
+ * itself, which runs under mmap_lock and so must not take
+ * usb_monitor_mutex.
+ *
+ * Called with usb_monitor_mutex held.
+ *
+ * @param reader;
+ */
+static void usb_monitor_sync(struct usb_monitor_reader_t *reader){
+    if (!READ_ONCE(reader->via_header))
+        return;
+
+    // Pairs with the barrier in usb_monitor_mmap;
+    smp_rmb();
+    if (atomic_read(&reader->mapped) == 0) {
+        WRITE_ONCE(reader->cursor, monitor->usb_message_index_write - usb_monitor_pending());
+        WRITE_ONCE(reader->via_header, 0);
+    }
+}
+
+
+/**
+ * Number of messages a reader has left, through the header or its cursor;
+ *
+ * @param reader;
+ *
+ * @return count of unread messages;
+ */
+static __u32 usb_monitor_reader_pending(struct usb_monitor_reader_t *reader){
+    return READ_ONCE(reader->via_header) ? usb_monitor_pending() : usb_monitor_unread(reader);
+}
+
+
+/**
+ * Number of messages in the per-CPU buffers, not yet in the circular queue;
+ *
+ * @return count of staged messages;
+ */
+static __u32 usb_monitor_staged(void){
+    __u32 count = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct usb_monitor_cpu_t *c = per_cpu_ptr(monitor->cpus, cpu);
+
+        count += smp_load_acquire(&c->head) - READ_ONCE(c->tail);
+    }
+    return count;
+}
+
+
+/**
+ * Fill in the event counters summed over the CPUs;
+ *
+ * Taken without stopping the producers, so recorded + dropped may trail
+ * sequence by the events in flight;
+ *
+ * @param OUT stats;
+ */
+static void usb_monitor_sum_stats(struct usb_monitor_stats_t *stats){
+    struct usb_monitor_filter_set_t *set;
+    int cpu;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->sequence = atomic64_read(&monitor->sequence);
+    for_each_possible_cpu(cpu) {
+        struct usb_monitor_cpu_t *c = per_cpu_ptr(monitor->cpus, cpu);
+
+        stats->recorded += READ_ONCE(c->recorded);
+        stats->dropped += READ_ONCE(c->dropped);
+    }
+
+    rcu_read_lock();
+    set = rcu_dereference(monitor->filter_set);
+    if (set) {
+        for_each_possible_cpu(cpu)
+            stats->filtered += READ_ONCE(per_cpu_ptr(set->hits, cpu)[USB_MONITOR_MAX_FILTERS]);
+    }
+    rcu_read_unlock();
+}
+
+
+/**
+ * Round a requested queue size to a power of two within the ABI limits;
+ *
+ * @param size: in messages;
+ *
+ * @return size in messages;
+ */
+static __u32 usb_monitor_ring_size(unsigned int size){
+    size = clamp_t(unsigned int, size, USB_MONITOR_MIN_RING_SIZE, USB_MONITOR_MAX_RING_SIZE);
+    return roundup_pow_of_two(size);
+}
+
+
+/**
+ * Allocate a circular queue, one header page followed by the messages;
+ *
+ * vmalloc_user, so it can be mapped to user space and needs no contiguous
+ * pages whatever its size;
+ *
+ * @param size: in messages, a power of two;
+ * @param OUT ring_bytes: size of the allocation;
+ *
+ * @return the ring, NULL on failure;
+ */
+static struct usb_monitor_ring_t *usb_monitor_alloc_ring(__u32 size, OUT size_t *ring_bytes){
+    struct usb_monitor_ring_t *ring;
+
+    *ring_bytes = PAGE_SIZE + (size_t)size * sizeof(struct usb_message_t);
+    ring = vmalloc_user(*ring_bytes);
+    if (!ring)
+        return NULL;
+
+    ring->message_buffer_size = size;
+    ring->message_size = sizeof(struct usb_message_t);
+    ring->message_offset = PAGE_SIZE;
+    return ring;
+}
+
+
+/**
+ * Replace the circular queue with one of another size
+ *
+ * Only while idle: no other reader has anything unread, so no message is
+ * lost to it, and nothing mapped, so no process keeps the old pages. The
+ * caller's own backlog is dropped and added to its missed count, a fresh
+ * open starts with whatever the queue still holds. The indexes carry on
+ * from the current write address, so sequence numbers and readers see no
+ * jump.
+ * Called with usb_monitor_mutex held, which keeps read() and the drain,
+ * the only writer of the queue, out; usb_monitor_ring_mutex keeps mmap() out.
+ *
+ * @param caller: reader of the file asking;
+ * @param size: in messages, a power of two;
+ *
+ * @return 0 on success, -EBUSY if not idle, -ENOMEM;
+ */
+static int usb_monitor_resize(struct usb_monitor_reader_t *caller, __u32 size){
+    struct usb_monitor_ring_t *ring, *old;
+    struct usb_monitor_reader_t *reader;
+    size_t ring_bytes;
+
+    if (size == monitor->ring_size)
+        return 0;
+
+    // A reader of the mapping does not move its cursor, mappings covers it;
+    list_for_each_entry(reader, &monitor->readers, node) {
+        usb_monitor_sync(reader);
+        if (reader != caller && !reader->via_header && usb_monitor_unread(reader) > 0)
+            return -EBUSY;
+    }
+
+    ring = usb_monitor_alloc_ring(size, &ring_bytes);
+    if (!ring)
+        return -ENOMEM;
+
+    mutex_lock(&monitor->usb_monitor_ring_mutex);
+    if (atomic_read(&monitor->mappings) > 0) {
+        mutex_unlock(&monitor->usb_monitor_ring_mutex);
+        vfree(ring);
+        return -EBUSY;
+    }
+    usb_monitor_catch_up(caller);
+    caller->missed += usb_monitor_unread(caller);
+    WRITE_ONCE(caller->cursor, monitor->usb_message_index_write);
+
+    ring->usb_message_index_write = monitor->usb_message_index_write;
+    ring->usb_message_index_claim = monitor->usb_message_index_write;
+    ring->usb_message_index_read = monitor->usb_message_index_write;
+    old = monitor->ring;
+    monitor->message = (struct usb_message_t *)((char *)ring + PAGE_SIZE);
+    monitor->ring_bytes = ring_bytes;
+    WRITE_ONCE(monitor->ring_filled, 0);
+    WRITE_ONCE(monitor->ring_size, size);
+    monitor->ring_mask = size - 1;
+    rcu_assign_pointer(monitor->ring, ring);
+    mutex_unlock(&monitor->usb_monitor_ring_mutex);
+
+    // Lockless pollers may still be reading the old header;
+    synchronize_rcu();
+    vfree(old);
+    return 0;
+}
+
+
+/**
+ * Move the staged messages to the circular queue in sequence order
+ *
+ * A merge of the per-CPU buffers, each of which is already in order. Only
+ * messages below a limit are moved: every sequence number below it has
+ * been published or dropped, so no older message can turn up later and the
+ * order in the queue is the global one. The limit is the next sequence
+ * number, lowered to the one of any producer caught between taking its
+ * number and publishing it. A full queue overwrites its oldest message,
+ * readers that had not read it yet are lapped. Called with
+ * usb_monitor_mutex held.
+ *
+ * @return number of messages moved;
+ */
+static __u32 usb_monitor_drain(void){
+    struct usb_monitor_cpu_t *c, *next;
+    struct usb_message_t *message;
+    __u64 limit, sequence;
+    __u32 moved = 0;
+    int cpu;
+
+    // Pairs with the fully ordered increment in write_message: a
+    // producer that took a number below the limit has its inflight visible;
+    limit = atomic64_read(&monitor->sequence);
+    smp_mb();
+    for_each_possible_cpu(cpu)
+        limit = min_t(__u64, limit, (__u64)atomic64_read_acquire(&per_cpu_ptr(monitor->cpus, cpu)->inflight));
+
+    while (1) {
+        next = NULL;
+        sequence = limit;
+        for_each_possible_cpu(cpu) {
+            c = per_cpu_ptr(monitor->cpus, cpu);
+            if (c->tail == smp_load_acquire(&c->head))
+                continue;
+            message = &c->message[c->tail & CPU_BUFFER_MASK];
+            if (message->sequence < sequence) {
+                sequence = message->sequence;
+                next = c;
+            }
+        }
+        if (!next)
+            break;
+
+        // Claim the slot before overwriting it, so a reader of the mapping
+        // still copying the old message can tell;
+        WRITE_ONCE(monitor->ring->usb_message_index_claim, monitor->usb_message_index_write + 1);
+        smp_wmb();
+        monitor->message[monitor->usb_message_index_write & monitor->ring_mask] =
+            next->message[next->tail & CPU_BUFFER_MASK];
+        monitor->usb_message_index_write++;
+        smp_store_release(&next->tail, next->tail + 1);
+        moved++;
+    }
+    if (moved)
+        WRITE_ONCE(monitor->ring_filled, min_t(__u32, monitor->ring_filled + moved, monitor->ring_size));
+
+    // Publish the messages, the consumer may read them as soon as the write
+    // address moves past them;
+    if (moved)
+        smp_store_release(&monitor->ring->usb_message_index_write, monitor->usb_message_index_write);
+    return moved;
+}
+
+
+/**
+ * Drain the buffers from a worker when they fill up and nobody reads;
+ */
+static void usb_monitor_drain_work(struct work_struct *work){
+    __u32 moved;
+
+    mutex_lock(&monitor->usb_monitor_mutex);
+    moved = usb_monitor_drain();
+    mutex_unlock(&monitor->usb_monitor_mutex);
+
+    if (moved)
+        wake_up_interruptible(&monitor->usb_monitor_queue);
+}
+
+
+/**
+ * Replace the installed filters, their counters restart;
+ *
+ * Producers still on the old set finish with it before it is freed.
+ * Called with usb_monitor_mutex held.
+ *
+ * @param filters: count 0 removes them;
+ *
+ * @return 0 on success, -ENOMEM;
+ */
+static int usb_monitor_install_filters(const struct usb_monitor_filters_t *filters){
+    struct usb_monitor_filter_set_t *set = NULL, *old;
+
+    if (filters->count > 0) {
+        set = kmalloc(sizeof(*set), GFP_KERNEL);
+        if (!set)
+            return -ENOMEM;
+        set->hits = __alloc_percpu(sizeof(__u64) * (USB_MONITOR_MAX_FILTERS + 1), __alignof__(__u64));
+        if (!set->hits) {
+            kfree(set);
+            return -ENOMEM;
+        }
+        set->filters = *filters;
+    }
+
+    old = rcu_dereference_protected(monitor->filter_set, lockdep_is_held(&monitor->usb_monitor_mutex));
+    rcu_assign_pointer(monitor->filter_set, set);
+    if (old) {
+        synchronize_rcu();
+        free_percpu(old->hits);
+        kfree(old);
+    }
+    return 0;
+}
+
+
+/**
+ * The installed filters with their counters summed over the CPUs;
+ *
+ * Called with usb_monitor_mutex held.
+ *
+ * @param OUT filters;
+ */
+static void usb_monitor_get_filters(struct usb_monitor_filters_t *filters){
+    struct usb_monitor_filter_set_t *set;
+    __u32 i;
+    int cpu;
+
+    set = rcu_dereference_protected(monitor->filter_set, lockdep_is_held(&monitor->usb_monitor_mutex));
+    if (!set) {
+        memset(filters, 0, sizeof(*filters));
+        return;
+    }
+
+    *filters = set->filters;
+    for_each_possible_cpu(cpu) {
+        __u64 *hits = per_cpu_ptr(set->hits, cpu);
+
+        for (i = 0; i < filters->count; i++)
+            filters->filter[i].hits += READ_ONCE(hits[i]);
+        filters->rejected += READ_ONCE(hits[USB_MONITOR_MAX_FILTERS]);
+    }
+}
+
+
+/**
+ * Implementation of the open interface
+ *
+ * Gives the file its own cursor at the oldest message in the queue, so a
+ * reader started late still gets what was recorded before it.
+ *
+ * @param inode;
+ * @param filp;
+ *
+ * @return 0 on success, -ENOMEM;
+ */
+static int usb_monitor_open(struct inode *inode, struct file *filp){
+    struct usb_monitor_reader_t *reader;
+
+    reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+    if (!reader)
+        return -ENOMEM;
+
+    mutex_lock(&monitor->usb_monitor_mutex);
+    reader->cursor = monitor->usb_message_index_write - monitor->ring_filled;
+    list_add_tail(&reader->node, &monitor->readers);
+    mutex_unlock(&monitor->usb_monitor_mutex);
+
+    filp->private_data = reader;
+    return 0;
+}
+
+
+/**
+ * Implementation of the release interface
+ *
+ * @param inode;
+ * @param filp;
+ *
+ * @return 0;
+ */
+static int usb_monitor_release(struct inode *inode, struct file *filp){
+    struct usb_monitor_reader_t *reader = filp->private_data;
+
+    mutex_lock(&monitor->usb_monitor_mutex);
+    list_del(&reader->node);
+    mutex_unlock(&monitor->usb_monitor_mutex);
+
+    kfree(reader);
+    return 0;
+}
+
 
 /**
  * Implementation of the read interface
- * 
+ *
+ * Moves the staged messages to the circular queue, then copies as many
+ * whole messages from the file's cursor as fit in the user buffer with at
+ * most two copies, one for each side of the circular queue wrap-around.
+ * Other open files keep their own cursors and still get the messages.
+ *
  * @param filp;
  * @param buf;
  * @param ppos;
  *
- * @return size of message;
+ * @return size of the copied messages;
  */
 static ssize_t usb_monitor_read(struct file *filp, char __user *buf, size_t size, loff_t *ppos){
-    int index;
+    struct usb_monitor_reader_t *reader = filp->private_data;
+    __u32 read, index, count, first, pending;
     size_t message_size = sizeof(struct usb_message_t);
 
-    LOGI("%s:%s\n", TAG, __func__);
+    pr_debug("%s:%s\n", TAG, __func__);
+    COUNT(reads);
 
     if (size < message_size) {
         LOGE("%s:read size is smaller than message size!\n", TAG);
         return -EINVAL;
     }
 
-    wait_event_interruptible(monitor->usb_monitor_queue, monitor->usb_message_count > 0);
-    LOGI("%s:read wait event pass\n", TAG);
-
-    // Get lock;
-    mutex_lock(&monitor->usb_monitor_mutex);
-
-    // Read data from kernel space to user space if there is data in the circular queue;
-    if (monitor->usb_message_count > 0) {
-        index = monitor->usb_message_index_read;
+    while (1) {
+        // Get lock, only against other readers;
+        mutex_lock(&monitor->usb_monitor_mutex);
+        usb_monitor_drain();
+        usb_monitor_sync(reader);
+        usb_monitor_catch_up(reader);
+        pending = usb_monitor_unread(reader);
+        if (pending > 0)
+            break;
+        mutex_unlock(&monitor->usb_monitor_mutex);
 
-        if (copy_to_user(buf, &monitor->message[index], message_size)) {
-            LOGE("%s:copy_from_user error!\n", TAG);
-            // Unlock;
-            mutex_unlock(&monitor->usb_monitor_mutex);
-            return -EFAULT;
+        if (filp->f_flags & O_NONBLOCK) {
+            COUNT(empty_reads);
+            return -EAGAIN;
         }
 
-        // Add 1 to the read address in the circular queue;
-        monitor->usb_message_index_read++;
+        // Staged messages held back by a producer in flight are moved on
+        // the next pass, it is about to publish;
+        if (wait_event_interruptible(monitor->usb_monitor_queue,
+                                     usb_monitor_unread(reader) > 0 || usb_monitor_staged() > 0))
+            return -ERESTARTSYS;
+        pr_debug("%s:read wait event pass\n", TAG);
+    }
+
+    // Number of whole messages that fit in the user buffer;
+    read = reader->cursor;
+    count = min_t(__u32, pending, size / message_size);
+    index = read & monitor->ring_mask;
 
-        // If the read address exceeds the maximum value of the circular queue address, 
-        // set to zero;
-        if (monitor->usb_message_index_read >= MESSAGE_BUFFER_SIZE){
-            monitor->usb_message_index_read = 0;
-        }
+    // Messages up to the end of the circular queue, the rest wraps to zero;
+    first = min_t(__u32, count, monitor->ring_size - index);
 
-        // After reading the data, the total amount of data in the queue is subtracted by one
-        monitor->usb_message_count--;
+    if (copy_to_user(buf, &monitor->message[index], first * message_size) ||
+        copy_to_user(buf + first * message_size, &monitor->message[0],
+                     (count - first) * message_size)) {
+        LOGE("%s:copy_to_user error!\n", TAG);
+        // Unlock;
+        mutex_unlock(&monitor->usb_monitor_mutex);
+        return -EFAULT;
     }
 
+    // Move this file's cursor forward by the number of messages copied;
+    WRITE_ONCE(reader->cursor, read + count);
+
     // Unlock;
     mutex_unlock(&monitor->usb_monitor_mutex);
 
-    LOGI("%s:read count:%d\n", TAG, message_size);
+    COUNT_ADD(bytes_copied, count * message_size);
+    if (count < pending)
+        COUNT(partial_reads);
+    pr_debug("%s:read count:%d\n", TAG, count);
 
-    return message_size;
+    return count * message_size;
 }
 
 
@@ -182,22 +757,34 @@ static ssize_t usb_monitor_write(struct file *filp, const char __user *buf, size
  * @return mask
  */
 static unsigned int usb_monitor_poll(struct file *filp, struct poll_table_struct *wait){
+    struct usb_monitor_reader_t *reader = filp->private_data;
     unsigned int mask = 0;
 
-    LOGI("%s:%s\n", TAG, __func__);
+    pr_debug("%s:%s\n", TAG, __func__);
+    COUNT(polls);
 
     poll_wait(filp, &monitor->usb_monitor_queue, wait);
 
-    mutex_lock(&monitor->usb_monitor_mutex);
-    if (monitor->usb_message_count > 0){
+    // A reader of the mapping never calls read(), so the staged messages are
+    // moved to the queue here;
+    if (usb_monitor_staged() > 0) {
+        mutex_lock(&monitor->usb_monitor_mutex);
+        usb_monitor_drain();
+        mutex_unlock(&monitor->usb_monitor_mutex);
+    }
+
+    // The write address is published with a release store, no lock needed;
+    if (usb_monitor_reader_pending(reader) > 0){
         mask |= POLLIN | POLLRDNORM;
     }
-    mutex_unlock(&monitor->usb_monitor_mutex);
 
     return mask;
 }
 
 
+static int usb_monitor_stress(struct usb_monitor_stress_t *stress);
+
+
 /**
  * Implementation of the ioctl interface
  *
@@ -205,13 +792,46 @@ static unsigned int usb_monitor_poll(struct file *filp, struct poll_table_struct
  * @param cmd;
  * @param arg;
  *
- * @return 0;
+ * @return 0, -EPROTO for an abi mismatch, -EINVAL for too many filters,
+ *         -EBUSY for a resize while messages are pending or the ring is mapped
+ *         or for a second CMD_STRESS;
  */
 static long usb_monitor_ioctl(struct file *filp, unsigned int cmd, unsigned long arg){
     void __user *ubuf = (void __user *)arg;
     unsigned char status;
-
-    LOGI("%s:%s\n", TAG, __func__);
+    struct usb_monitor_abi_t abi;
+    struct usb_monitor_filters_t *filters;
+    struct usb_monitor_stats_t stats;
+    struct usb_monitor_counters_t counters;
+    struct usb_monitor_stress_t stress;
+    struct usb_monitor_cursor_t cursor;
+    struct usb_monitor_reader_t *reader = filp->private_data, *r;
+    __u32 size;
+    int ret = 0, i;
+
+    pr_debug("%s:%s\n", TAG, __func__);
+    COUNT(ioctls);
+
+    // Runs as long as the producers take, so without usb_monitor_mutex,
+    // which the readers need to drain them;
+    if (cmd == CMD_STRESS) {
+        if (!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        if (copy_from_user(&stress, ubuf, sizeof(stress))) {
+            LOGE("%s:ioctl:copy_from_user fail\n", TAG);
+            return -EFAULT;
+        }
+        ret = usb_monitor_stress(&stress);
+        if (ret)
+            return ret;
+        LOGI("%s:ioctl:stress %u cpus recorded %llu dropped %llu in %llu ns\n", TAG, stress.cpus,
+             stress.recorded, stress.dropped, stress.elapsed_ns);
+        if (copy_to_user(ubuf, &stress, sizeof(stress))) {
+            LOGE("%s:ioctl:copy_to_user fail\n", TAG);
+            return -EFAULT;
+        }
+        return 0;
+    }
 
     mutex_lock(&monitor->usb_monitor_mutex);
 
@@ -231,6 +851,131 @@ static long usb_monitor_ioctl(struct file *filp, unsigned int cmd, unsigned long
             return -EFAULT;
         }
         break;
+    case CMD_GET_ABI:
+        if (copy_from_user(&abi, ubuf, sizeof(abi))) {
+            LOGE("%s:ioctl:copy_from_user fail\n", TAG);
+            mutex_unlock(&monitor->usb_monitor_mutex);
+            return -EFAULT;
+        }
+
+        // A reader built against another layout cannot decode our records;
+        if (abi.version != USB_MONITOR_ABI_VERSION || abi.message_size != sizeof(struct usb_message_t)) {
+            LOGE("%s:ioctl:abi mismatch: version=%u size=%u\n", TAG, abi.version, abi.message_size);
+            ret = -EPROTO;
+        }
+
+        abi.version = USB_MONITOR_ABI_VERSION;
+        abi.message_size = sizeof(struct usb_message_t);
+        abi.message_buffer_size = monitor->ring_size;
+        abi.reserved = 0;
+
+        if (copy_to_user(ubuf, &abi, sizeof(abi))) {
+            LOGE("%s:ioctl:copy_to_user fail\n", TAG);
+            mutex_unlock(&monitor->usb_monitor_mutex);
+            return -EFAULT;
+        }
+        break;
+    case CMD_SET_FILTERS:
+        filters = kmalloc(sizeof(*filters), GFP_KERNEL);
+        if (!filters) {
+            mutex_unlock(&monitor->usb_monitor_mutex);
+            return -ENOMEM;
+        }
+        if (copy_from_user(filters, ubuf, sizeof(*filters))) {
+            LOGE("%s:ioctl:copy_from_user fail\n", TAG);
+            kfree(filters);
+            mutex_unlock(&monitor->usb_monitor_mutex);
+            return -EFAULT;
+        }
+        if (filters->count > USB_MONITOR_MAX_FILTERS) {
+            kfree(filters);
+            mutex_unlock(&monitor->usb_monitor_mutex);
+            return -EINVAL;
+        }
+
+        // The counters restart with the new table;
+        filters->rejected = 0;
+        for (i = 0; i < USB_MONITOR_MAX_FILTERS; i++) {
+            filters->filter[i].hits = 0;
+            filters->filter[i].name_prefix[USB_MONITOR_NAME_LENG - 1] = 0;
+        }
+
+        ret = usb_monitor_install_filters(filters);
+        if (ret == 0)
+            LOGI("%s:ioctl:%u filters installed\n", TAG, filters->count);
+        kfree(filters);
+        break;
+    case CMD_GET_FILTERS:
+        filters = kmalloc(sizeof(*filters), GFP_KERNEL);
+        if (!filters) {
+            mutex_unlock(&monitor->usb_monitor_mutex);
+            return -ENOMEM;
+        }
+
+        usb_monitor_get_filters(filters);
+
+        if (copy_to_user(ubuf, filters, sizeof(*filters))) {
+            LOGE("%s:ioctl:copy_to_user fail\n", TAG);
+            kfree(filters);
+            mutex_unlock(&monitor->usb_monitor_mutex);
+            return -EFAULT;
+        }
+        kfree(filters);
+        break;
+    case CMD_GET_STATS:
+        usb_monitor_sum_stats(&stats);
+
+        if (copy_to_user(ubuf, &stats, sizeof(stats))) {
+            LOGE("%s:ioctl:copy_to_user fail\n", TAG);
+            mutex_unlock(&monitor->usb_monitor_mutex);
+            return -EFAULT;
+        }
+        break;
+    case CMD_GET_COUNTERS:
+        usb_monitor_sum_counters(&counters);
+        if (copy_to_user(ubuf, &counters, sizeof(counters))) {
+            LOGE("%s:ioctl:copy_to_user fail\n", TAG);
+            mutex_unlock(&monitor->usb_monitor_mutex);
+            return -EFAULT;
+        }
+        break;
+    case CMD_GET_CURSOR:
+        usb_monitor_sync(reader);
+        if (!reader->via_header)
+            usb_monitor_catch_up(reader);
+        memset(&cursor, 0, sizeof(cursor));
+        cursor.missed = reader->missed;
+        cursor.unread = usb_monitor_reader_pending(reader);
+        list_for_each_entry(r, &monitor->readers, node)
+            cursor.readers++;
+
+        if (copy_to_user(ubuf, &cursor, sizeof(cursor))) {
+            LOGE("%s:ioctl:copy_to_user fail\n", TAG);
+            mutex_unlock(&monitor->usb_monitor_mutex);
+            return -EFAULT;
+        }
+        break;
+    case CMD_SET_RING_SIZE:
+        if (copy_from_user(&size, ubuf, sizeof(size))) {
+            LOGE("%s:ioctl:copy_from_user fail\n", TAG);
+            mutex_unlock(&monitor->usb_monitor_mutex);
+            return -EFAULT;
+        }
+        size = usb_monitor_ring_size(size);
+        ret = usb_monitor_resize(reader, size);
+        if (ret) {
+            LOGE("%s:ioctl:resize to %u fail %d\n", TAG, size, ret);
+            break;
+        }
+        LOGI("%s:ioctl:ring size %u\n", TAG, size);
+
+        // Tell the caller what it got after rounding;
+        if (copy_to_user(ubuf, &size, sizeof(size))) {
+            LOGE("%s:ioctl:copy_to_user fail\n", TAG);
+            mutex_unlock(&monitor->usb_monitor_mutex);
+            return -EFAULT;
+        }
+        break;
     default:
         LOGE("%s:invalid cmd\n", TAG);
         mutex_unlock(&monitor->usb_monitor_mutex);
@@ -239,6 +984,152 @@ static long usb_monitor_ioctl(struct file *filp, unsigned int cmd, unsigned long
 
     mutex_unlock(&monitor->usb_monitor_mutex);
 
+    return ret;
+}
+
+
+/**
+ * Count the mappings of the ring, in all and per file, a copy made by fork()
+ * or a split of the area is one more; the initial one is counted by
+ * usb_monitor_mmap. The file, and so its reader, lives as long as any area.
+ */
+static void usb_monitor_vm_open(struct vm_area_struct *vma){
+    struct usb_monitor_reader_t *reader = vma->vm_file->private_data;
+
+    atomic_inc(&reader->mapped);
+    atomic_inc(&monitor->mappings);
+}
+
+static void usb_monitor_vm_close(struct vm_area_struct *vma){
+    struct usb_monitor_reader_t *reader = vma->vm_file->private_data;
+
+    atomic_dec(&reader->mapped);
+    atomic_dec(&monitor->mappings);
+}
+
+static const struct vm_operations_struct usb_monitor_vm_ops = {
+    .open = usb_monitor_vm_open,
+    .close = usb_monitor_vm_close,
+};
+
+
+/**
+ * Implementation of the mmap interface
+ *
+ * Maps the header page or the circular queue so that user space can copy
+ * messages out without a syscall: the header at offset 0, at most a page,
+ * and the messages at message_offset, read only, so a mapping never writes
+ * over what read() readers still get. Both are one file's at a time, the
+ * header holds a single read address; another file gets -EBUSY until they
+ * are all unmapped. The file then consumes the queue through the header
+ * read address until its last area is unmapped.
+ *
+ * @param filp;
+ * @param vma;
+ *
+ * @return 0 on success;
+ */
+static int usb_monitor_mmap(struct file *filp, struct vm_area_struct *vma){
+    struct usb_monitor_reader_t *reader = filp->private_data;
+    unsigned long size = vma->vm_end - vma->vm_start;
+    int ret;
+
+    LOGI("%s:%s\n", TAG, __func__);
+
+    // Against CMD_SET_RING_SIZE replacing the ring; mmap_lock is held here,
+    // so not usb_monitor_mutex, which read() holds while it may fault;
+    mutex_lock(&monitor->usb_monitor_ring_mutex);
+
+    if (atomic_read(&monitor->mappings) > 0 && monitor->mapper != reader) {
+        LOGE("%s:mmap: mapped by another file\n", TAG);
+        mutex_unlock(&monitor->usb_monitor_ring_mutex);
+        return -EBUSY;
+    }
+
+    if (vma->vm_pgoff == 0) {
+        ret = size > PAGE_SIZE ? -EINVAL : 0;
+    } else if (vma->vm_pgoff == monitor->ring->message_offset >> PAGE_SHIFT) {
+        ret = size > PAGE_ALIGN(monitor->ring_bytes) - monitor->ring->message_offset ? -EINVAL : 0;
+        if (vma->vm_flags & VM_WRITE)
+            ret = -EPERM;
+    } else {
+        ret = -EINVAL;
+    }
+    if (ret) {
+        LOGE("%s:invalid mmap range: offset = %lu size = %lu\n", TAG, vma->vm_pgoff, size);
+        mutex_unlock(&monitor->usb_monitor_ring_mutex);
+        return ret;
+    }
+
+    // Nor may mprotect() make the messages writable later;
+    if (vma->vm_pgoff != 0) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+        vm_flags_clear(vma, VM_MAYWRITE);
+#else
+        vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    }
+
+    ret = remap_vmalloc_range(vma, monitor->ring, vma->vm_pgoff);
+    if (ret == 0) {
+        vma->vm_ops = &usb_monitor_vm_ops;
+        monitor->mapper = reader;
+        atomic_inc(&reader->mapped);
+        atomic_inc(&monitor->mappings);
+        // A reader that sees via_header sees the area counted, see usb_monitor_sync;
+        smp_mb__after_atomic();
+        WRITE_ONCE(reader->via_header, 1);
+    }
+
+    mutex_unlock(&monitor->usb_monitor_ring_mutex);
+    return ret;
+}
+
+
+/**
+ * Contents of /proc/usb_monitor_stats, one "name value" per line
+ *
+ * @param m;
+ * @param v;
+ *
+ * @return 0;
+ */
+static int usb_monitor_stats_show(struct seq_file *m, void *v){
+    struct usb_monitor_counters_t counters;
+    struct usb_monitor_stats_t stats;
+    struct usb_monitor_reader_t *reader;
+    __u32 readers = 0, pending = 0;
+    __u64 missed = 0;
+
+    usb_monitor_sum_counters(&counters);
+
+    usb_monitor_sum_stats(&stats);
+
+    // Pending is what the furthest behind reader has left;
+    mutex_lock(&monitor->usb_monitor_mutex);
+    list_for_each_entry(reader, &monitor->readers, node) {
+        readers++;
+        pending = max_t(__u32, pending, usb_monitor_reader_pending(reader));
+        missed += reader->missed;
+    }
+    mutex_unlock(&monitor->usb_monitor_mutex);
+
+    seq_printf(m, "notifier_calls %llu\n", counters.notifier_calls);
+    seq_printf(m, "wakeups %llu\n", counters.wakeups);
+    seq_printf(m, "reads %llu\n", counters.reads);
+    seq_printf(m, "empty_reads %llu\n", counters.empty_reads);
+    seq_printf(m, "partial_reads %llu\n", counters.partial_reads);
+    seq_printf(m, "bytes_copied %llu\n", counters.bytes_copied);
+    seq_printf(m, "polls %llu\n", counters.polls);
+    seq_printf(m, "ioctls %llu\n", counters.ioctls);
+    seq_printf(m, "sequence %llu\n", stats.sequence);
+    seq_printf(m, "recorded %llu\n", stats.recorded);
+    seq_printf(m, "dropped %llu\n", stats.dropped);
+    seq_printf(m, "filtered %llu\n", stats.filtered);
+    seq_printf(m, "readers %u\n", readers);
+    seq_printf(m, "pending %u\n", pending);
+    seq_printf(m, "missed %llu\n", missed);
+    seq_printf(m, "staged %u\n", usb_monitor_staged());
     return 0;
 }
 
@@ -254,64 +1145,244 @@ static const struct proc_ops usb_monitor_fops = {
     .proc_write = usb_monitor_write,
     .proc_poll = usb_monitor_poll,
     .proc_ioctl = usb_monitor_ioctl,
-;
+    .proc_mmap = usb_monitor_mmap,
+};
 #else
 static const struct file_operations usb_monitor_fops = {
     .owner = THIS_MODULE,
+    .open = usb_monitor_open,
+    .release = usb_monitor_release,
     .read = usb_monitor_read,
     .write = usb_monitor_write,
     .poll = usb_monitor_poll,
     .unlocked_ioctl = usb_monitor_ioctl,
+    .mmap = usb_monitor_mmap,
+};
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,18,0)
+static int usb_monitor_stats_open(struct inode *inode, struct file *filp){
+    return single_open(filp, usb_monitor_stats_show, NULL);
+}
+
+static const struct file_operations usb_monitor_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = usb_monitor_stats_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
 };
 #endif
 
 
 /**
- * Writing data to the circular queue;
+ * Writing data to this CPU's staging buffer;
+ *
+ * Takes no lock. Preemption is off, so the buffer has a single producer,
+ * and the sequence number is one atomic increment; inflight tells the drain
+ * which numbers may be taken but not yet published. When the buffer is
+ * full the new message is dropped, the staged messages are never
+ * overwritten. Nothing in here may sleep or log.
  *
  * @param status;
+ * @param usb_dev: NULL for a CMD_STRESS event;
+ *
+ * @return messages staged on this CPU, -ENOSPC if the buffer is full;
+ */
+static int write_message(char status, struct usb_device *usb_dev){
+
+    struct usb_monitor_cpu_t *cpu;
+    struct usb_message_t *message;
+    __u64 sequence;
+    __u32 staged;
+
+    cpu = get_cpu_ptr(monitor->cpus);
+
+    // A lower bound of the number about to be taken; the increment is fully
+    // ordered, so the bound is visible before the number is;
+    atomic64_set(&cpu->inflight, atomic64_read(&monitor->sequence));
+    sequence = atomic64_inc_return(&monitor->sequence) - 1;
+    atomic64_set(&cpu->inflight, sequence);
+
+    staged = cpu->head - smp_load_acquire(&cpu->tail);
+    if (staged >= CPU_BUFFER_SIZE) {
+        // A dropped event still takes its sequence number, so readers see the gap;
+        cpu->dropped++;
+        atomic64_set_release(&cpu->inflight, INFLIGHT_NONE);
+        put_cpu_ptr(monitor->cpus);
+        return -ENOSPC;
+    }
+
+    message = &cpu->message[cpu->head & CPU_BUFFER_MASK];
+
+    // The slot is reused, no stale bytes may reach user space;
+    memset(message, 0, sizeof(*message));
+    message->kernel_time = ktime_to_ns(ktime_get());
+    message->sequence = sequence;
+    message->plug_flag = status;
+
+    if (usb_dev) {
+        // Determine if the device name is empty to avoid crashing the program;
+        // The copies are bounded by the message, longer strings are truncated;
+        strncpy(message->usb_name, usb_dev->product ? usb_dev->product : "NULL",
+                sizeof(message->usb_name) - 1);
+        if (usb_dev->serial)
+            strncpy(message->serial, usb_dev->serial, sizeof(message->serial) - 1);
+
+        // Identity and topology, so user space never walks sysfs per event;
+        message->vendor = le16_to_cpu(usb_dev->descriptor.idVendor);
+        message->product = le16_to_cpu(usb_dev->descriptor.idProduct);
+        message->bcd_device = le16_to_cpu(usb_dev->descriptor.bcdDevice);
+        message->device_class = usb_dev->descriptor.bDeviceClass;
+        message->busnum = usb_dev->bus->busnum;
+        message->devnum = usb_dev->devnum;
+        message->speed = usb_dev->speed;
+    } else {
+        snprintf(message->usb_name, sizeof(message->usb_name), "stress-cpu%d", smp_processor_id());
+    }
+
+    // Publish the message to the drain, then leave inflight;
+    smp_store_release(&cpu->head, cpu->head + 1);
+    cpu->recorded++;
+    atomic64_set_release(&cpu->inflight, INFLIGHT_NONE);
+
+    put_cpu_ptr(monitor->cpus);
+    return staged + 1;
+}
+
+
+/**
+ * Whether the device has an interface of the given class in any configuration;
+ *
+ * Uses the cached configuration descriptors, which outlive actconfig, so a
+ * device matches the same way when it is removed as when it was added.
+ *
  * @param usb_dev;
- * @param OUT index;
+ * @param device_class;
+ *
+ * @return 1 if it has one;
  */
-void write_message(char status,struct usb_device *usb_dev, OUT int *index){
+static int usb_monitor_has_class(struct usb_device *usb_dev, __u8 device_class){
+    int c, i;
 
-    int tmp_index;
+    if (usb_dev->descriptor.bDeviceClass == device_class)
+        return 1;
+    if (!usb_dev->config)
+        return 0;
 
-    LOGI("%s:%s\n", TAG, __func__);
+    for (c = 0; c < usb_dev->descriptor.bNumConfigurations; c++) {
+        struct usb_host_config *config = &usb_dev->config[c];
 
-    tmp_index = monitor->usb_message_index_write;
-    monitor->message[tmp_index].kernel_time = ktime_to_ns(ktime_get());
+        for (i = 0; i < config->desc.bNumInterfaces && i < USB_MAXINTERFACES; i++) {
+            struct usb_interface_cache *intf = config->intf_cache[i];
 
-    // Determine if the device name is empty to avoid crashing the program;
-    if(usb_dev->product){
-        printk("write_message %ld\n", strlen(usb_dev->product));
-        memcpy(monitor->message[tmp_index].usb_name,usb_dev->product,strlen(usb_dev->product) );
-    }else{
-        memcpy(monitor->message[tmp_index].usb_name, "NULL", 4);
-        printk("write_message get nothing\n");
+            if (intf && intf->num_altsetting > 0 &&
+                intf->altsetting[0].desc.bInterfaceClass == device_class)
+                return 1;
+        }
     }
-    // Record usb device plugging status;
-    monitor->message[tmp_index].plug_flag = status;
+    return 0;
+}
 
-    // Add one to the number of data in the circular queue
-    if (monitor->usb_message_count < MESSAGE_BUFFER_SIZE){
-        monitor->usb_message_count++;
-    }
 
-    // If the read address exceeds the maximum value of the circular queue address,
-    // set to zero;
-    monitor->usb_message_index_write++;
-    if (monitor->usb_message_index_write >= MESSAGE_BUFFER_SIZE){
-        monitor->usb_message_index_write = 0;
+/**
+ * Run the installed filters on a device;
+ *
+ * Lockless, the set is read under RCU and counts its hits per CPU.
+ *
+ * @param usb_dev;
+ *
+ * @return 1 if the event is to be recorded;
+ */
+static int usb_monitor_filter(struct usb_device *usb_dev){
+    struct usb_monitor_filter_set_t *set;
+    struct usb_monitor_filters_t *filters;
+    __u32 i;
+
+    rcu_read_lock();
+    set = rcu_dereference(monitor->filter_set);
+    if (!set) {
+        rcu_read_unlock();
+        return 1;
     }
+    filters = &set->filters;
+
+    for (i = 0; i < filters->count; i++) {
+        struct usb_monitor_filter_t *filter = &filters->filter[i];
+
+        if ((filter->match & USB_MONITOR_MATCH_VENDOR) &&
+            le16_to_cpu(usb_dev->descriptor.idVendor) != filter->vendor)
+            continue;
+        if ((filter->match & USB_MONITOR_MATCH_PRODUCT) &&
+            le16_to_cpu(usb_dev->descriptor.idProduct) != filter->product)
+            continue;
+        if ((filter->match & USB_MONITOR_MATCH_BUS) && usb_dev->bus->busnum != filter->busnum)
+            continue;
+        if ((filter->match & USB_MONITOR_MATCH_HUB) &&
+            (!usb_dev->parent || usb_dev->parent->devnum != filter->hub_devnum))
+            continue;
+        if ((filter->match & USB_MONITOR_MATCH_NAME_PREFIX) &&
+            (!usb_dev->product ||
+             strncmp(usb_dev->product, filter->name_prefix, strlen(filter->name_prefix)) != 0))
+            continue;
+        if ((filter->match & USB_MONITOR_MATCH_CLASS) && !usb_monitor_has_class(usb_dev, filter->device_class))
+            continue;
+
+        this_cpu_inc(set->hits[i]);
+        rcu_read_unlock();
+        return 1;
+    }
+
+    this_cpu_inc(set->hits[USB_MONITOR_MAX_FILTERS]);
+    rcu_read_unlock();
+    return 0;
+}
+
+
+/**
+ * Wake the readers after a message was staged;
+ *
+ * They move it to the circular queue. A buffer filling up while nobody
+ * reads is drained by the worker, so it keeps the queue's backlog.
+ *
+ * @param staged: messages staged on this CPU;
+ */
+static void usb_monitor_wake(int staged){
+    if (staged >= CPU_BUFFER_SIZE / 2)
+        schedule_work(&monitor->drain_work);
+
+    // Wake up;
+    COUNT(wakeups);
+    wake_up_interruptible(&monitor->usb_monitor_queue);
+}
+
+
+/**
+ * Record an event that passed the filters and wake the readers;
+ *
+ * @param status;
+ * @param usb_dev: NULL for a CMD_STRESS event;
+ *
+ * @return 0 on success, -ENOSPC if this CPU's buffer is full;
+ */
+static int usb_monitor_submit(char status, struct usb_device *usb_dev){
+    int staged = write_message(status, usb_dev);
+
+    if (staged < 0)
+        return staged;
 
-    *index = tmp_index;
+    usb_monitor_wake(staged);
+    return 0;
 }
 
 
 /**
  * Implementation of notifier callback function;
  *
+ * Runs on the USB core's notifier chain, which may be entered by several hubs
+ * at once. Nothing is serialized: each CPU records into its own buffer and
+ * the sequence number is one atomic increment, readers never block it.
+ *
  * @param self;
  * @param event;
  * @param dev;
@@ -319,10 +1390,10 @@ void write_message(char status,struct usb_device *usb_dev, OUT int *index){
 static int usb_notifier_callback(struct notifier_block *self, unsigned long event, void *dev) {
 
     struct usb_device *usb_dev = (struct usb_device*)dev;
-    int index;
+    char status;
+    int ret;
 
-    // Get locked
-    mutex_lock(&monitor->usb_monitor_mutex);
+    COUNT(notifier_calls);
 
     switch (event) {
 //         #define USB_DEVICE_ADD     0x0001
@@ -331,58 +1402,278 @@ static int usb_notifier_callback(struct notifier_block *self, unsigned long even
 //         #define USB_BUS_REMOVE     0x0004
 
         case USB_DEVICE_ADD:
-            write_message(1, usb_dev, &index);
-            printk(KERN_INFO "The add device name is %s %d\n", monitor->message[index].usb_name,
-            monitor->usb_message_count);
-            // Wake up;
-            wake_up_interruptible(&monitor->usb_monitor_queue);
+            status = 1;
             break;
-
         case USB_DEVICE_REMOVE:
-            write_message(0, usb_dev, &index);
-            printk(KERN_INFO "The remove device name is %s %d\n", monitor->message[index].usb_name, monitor->usb_message_count);
-            // Wake up;
-            wake_up_interruptible(&monitor->usb_monitor_queue);
+            status = 0;
             break;
         default:
-            break;
+            return NOTIFY_OK;
     }
-    
-    // Unlock;
-    mutex_unlock(&monitor->usb_monitor_mutex);
+
+    // Filtered out events cost neither a slot nor a wake up;
+    if (!usb_monitor_filter(usb_dev))
+        return NOTIFY_OK;
+
+    ret = usb_monitor_submit(status, usb_dev);
+    if (ret) {
+        // Counted in dropped; a storm of drops must not flood the log too;
+        pr_err_ratelimited("%s:message queue is full, drop message\n", TAG);
+        return NOTIFY_OK;
+    }
+
+    pr_debug("%s:The %s device name is %s\n", TAG, status ? "add" : "remove",
+             usb_dev->product ? usb_dev->product : "NULL");
 
     return NOTIFY_OK;
 }
 
 
+/*
+ * One CMD_STRESS run, on the stack of the ioctl waiting for it;
+ */
+struct usb_monitor_stress_run_t {
+    __u32  events;
+    __u32  flags;
+    atomic_t remaining;                 // Producers not done yet;
+    struct completion done;
+    atomic64_t recorded;
+    atomic64_t dropped;
+    atomic64_t producer_ns;
+    atomic64_t contended;
+};
+
+
+/**
+ * Producer thread of CMD_STRESS, bound to its CPU;
+ *
+ * Records like the notifier does, optionally serialized on the shared
+ * spinlock the way every producer used to be. Then waits for kthread_stop,
+ * so it is gone before the run on the ioctl's stack is.
+ *
+ * @param data: the run;
+ *
+ * @return 0;
+ */
+static int usb_monitor_stress_thread(void *data){
+    struct usb_monitor_stress_run_t *run = data;
+    __u64 recorded = 0, dropped = 0, contended = 0, ns = 0;
+    __s64 start;
+    __u32 i;
+    int staged;
+
+    start = ktime_to_ns(ktime_get());
+    for (i = 0; i < run->events; i++) {
+        if (run->flags & USB_MONITOR_STRESS_SERIALIZE) {
+            if (!spin_trylock(&monitor->usb_monitor_producer_lock)) {
+                contended++;
+                spin_lock(&monitor->usb_monitor_producer_lock);
+            }
+            staged = write_message((i & 1) == 0, NULL);
+            spin_unlock(&monitor->usb_monitor_producer_lock);
+        } else {
+            staged = write_message((i & 1) == 0, NULL);
+        }
+
+        if (staged < 0) {
+            dropped++;
+        } else {
+            recorded++;
+            usb_monitor_wake(staged);
+        }
+
+        // Let the readers in on this CPU, off the clock;
+        if ((i & 63) == 63) {
+            ns += ktime_to_ns(ktime_get()) - start;
+            cond_resched();
+            start = ktime_to_ns(ktime_get());
+        }
+    }
+    ns += ktime_to_ns(ktime_get()) - start;
+
+    atomic64_add(recorded, &run->recorded);
+    atomic64_add(dropped, &run->dropped);
+    atomic64_add(ns, &run->producer_ns);
+    atomic64_add(contended, &run->contended);
+    if (atomic_dec_and_test(&run->remaining))
+        complete(&run->done);
+
+    set_current_state(TASK_INTERRUPTIBLE);
+    while (!kthread_should_stop()) {
+        schedule();
+        set_current_state(TASK_INTERRUPTIBLE);
+    }
+    __set_current_state(TASK_RUNNING);
+    return 0;
+}
+
+
+/**
+ * Run CMD_STRESS, one producer thread per online CPU, started together;
+ *
+ * @param stress: events_per_cpu and flags in, the results out;
+ *
+ * @return 0 on success, -EBUSY if a run is going on, -EINVAL, -ENOMEM;
+ */
+static int usb_monitor_stress(struct usb_monitor_stress_t *stress){
+    struct usb_monitor_stress_run_t run;
+    struct task_struct **threads;
+    struct task_struct *thread;
+    __s64 start;
+    int cpu, count = 0, i;
+
+    if (stress->events_per_cpu == 0 || stress->events_per_cpu > STRESS_MAX_EVENTS)
+        return -EINVAL;
+    if (atomic_xchg(&monitor->stress_running, 1))
+        return -EBUSY;
+
+    threads = kcalloc(nr_cpu_ids, sizeof(*threads), GFP_KERNEL);
+    if (!threads) {
+        atomic_set(&monitor->stress_running, 0);
+        return -ENOMEM;
+    }
+
+    run.events = stress->events_per_cpu;
+    run.flags = stress->flags;
+    init_completion(&run.done);
+    atomic64_set(&run.recorded, 0);
+    atomic64_set(&run.dropped, 0);
+    atomic64_set(&run.producer_ns, 0);
+    atomic64_set(&run.contended, 0);
+
+    for_each_online_cpu(cpu) {
+        thread = kthread_create_on_node(usb_monitor_stress_thread, &run, cpu_to_node(cpu),
+                                        "usb_monitor_stress/%d", cpu);
+        if (IS_ERR(thread)) {
+            // Never woken, they stop without running;
+            for (i = 0; i < count; i++)
+                kthread_stop(threads[i]);
+            kfree(threads);
+            atomic_set(&monitor->stress_running, 0);
+            return PTR_ERR(thread);
+        }
+        kthread_bind(thread, cpu);
+        threads[count++] = thread;
+    }
+
+    atomic_set(&run.remaining, count);
+    start = ktime_to_ns(ktime_get());
+    for (i = 0; i < count; i++)
+        wake_up_process(threads[i]);
+    wait_for_completion(&run.done);
+    stress->elapsed_ns = ktime_to_ns(ktime_get()) - start;
+
+    for (i = 0; i < count; i++)
+        kthread_stop(threads[i]);
+    kfree(threads);
+
+    stress->cpus = count;
+    stress->reserved = 0;
+    stress->recorded = atomic64_read(&run.recorded);
+    stress->dropped = atomic64_read(&run.dropped);
+    stress->producer_ns = atomic64_read(&run.producer_ns);
+    stress->contended = atomic64_read(&run.contended);
+    atomic_set(&monitor->stress_running, 0);
+    return 0;
+}
+
+
+/**
+ * Free the per-CPU buffers, NULL messages are skipped;
+ */
+static void usb_monitor_free_cpus(void){
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        kfree(per_cpu_ptr(monitor->cpus, cpu)->message);
+    free_percpu(monitor->cpus);
+}
+
+
+/**
+ * Allocate the per-CPU buffers, each on its CPU's node;
+ *
+ * @return 0 on success, -ENOMEM;
+ */
+static int usb_monitor_alloc_cpus(void){
+    int cpu;
+
+    monitor->cpus = alloc_percpu(struct usb_monitor_cpu_t);
+    if (!monitor->cpus)
+        return -ENOMEM;
+
+    for_each_possible_cpu(cpu) {
+        struct usb_monitor_cpu_t *c = per_cpu_ptr(monitor->cpus, cpu);
+
+        c->message = kmalloc_node(CPU_BUFFER_SIZE * sizeof(struct usb_message_t), GFP_KERNEL, cpu_to_node(cpu));
+        if (!c->message) {
+            usb_monitor_free_cpus();
+            return -ENOMEM;
+        }
+        atomic64_set(&c->inflight, INFLIGHT_NONE);
+    }
+    return 0;
+}
+
+
 /**
  * Initialization
  */
 static int __init usb_monitor_init(void) { 
 
+    BUILD_BUG_ON(sizeof(struct usb_message_t) != 128);
+    BUILD_BUG_ON(sizeof(struct usb_monitor_filter_t) != 56);
+
     monitor = kzalloc(sizeof(struct usb_monitor_t), GFP_KERNEL);
 
     if (!monitor) {
         LOGE("%s:failed to kzalloc\n", TAG);
         return -ENOMEM;
     }
-    //  Initializing the circular queue
-    monitor->usb_message_count = 0;
-    monitor->usb_message_index_read = 0;
+    //  Initializing the circular queue, one header page followed by the messages;
+    monitor->ring_size = usb_monitor_ring_size(ring_size);
+    monitor->ring_mask = monitor->ring_size - 1;
+    monitor->ring = usb_monitor_alloc_ring(monitor->ring_size, &monitor->ring_bytes);
+    if (!monitor->ring) {
+        LOGE("%s:failed to vmalloc_user %u messages\n", TAG, monitor->ring_size);
+        kfree(monitor);
+        return -ENOMEM;
+    }
+    monitor->message = (struct usb_message_t *)((char *)monitor->ring + PAGE_SIZE);
+    atomic_set(&monitor->mappings, 0);
     monitor->usb_message_index_write = 0;
-    monitor->init_flag = "start the usb_monitor_init...\n";
+    monitor->ring_filled = 0;
+    INIT_LIST_HEAD(&monitor->readers);
 
-    //  Create file under /proc
-    proc_create("usb_monitor", 0644, NULL, &usb_monitor_fops);
+    if (usb_monitor_alloc_cpus()) {
+        LOGE("%s:failed to allocate the per-CPU buffers\n", TAG);
+        vfree(monitor->ring);
+        kfree(monitor);
+        return -ENOMEM;
+    }
+    atomic64_set(&monitor->sequence, 0);
+    atomic_set(&monitor->stress_running, 0);
+    INIT_WORK(&monitor->drain_work, usb_monitor_drain_work);
+    monitor->init_flag = "start the usb_monitor_init...\n";
 
     // Wait
     init_waitqueue_head(&monitor->usb_monitor_queue);
 
     mutex_init(&monitor->usb_monitor_mutex);
+    mutex_init(&monitor->usb_monitor_ring_mutex);
+    spin_lock_init(&monitor->usb_monitor_producer_lock);
     monitor->fb_notif.notifier_call = usb_notifier_callback;
 
     // Registering callback functions
     usb_register_notify(&monitor->fb_notif);
+
+    //  Create file under /proc, last: open() takes the locks set up above;
+    proc_create("usb_monitor", 0644, NULL, &usb_monitor_fops);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,18,0)
+    proc_create_single("usb_monitor_stats", 0444, NULL, usb_monitor_stats_show);
+#else
+    proc_create("usb_monitor_stats", 0444, NULL, &usb_monitor_stats_fops);
+#endif
     return 0;
 }
 
@@ -396,10 +1687,18 @@ static void __exit usb_monitor_exit(void)
 
     LOGI("%s:%s\n", TAG, __func__);
 
+    remove_proc_entry("usb_monitor_stats", NULL);
     remove_proc_entry("usb_monitor", NULL);
 
     usb_unregister_notify(&monitor->fb_notif); 
+    cancel_work_sync(&monitor->drain_work);
 
+    if (monitor->filter_set) {
+        free_percpu(monitor->filter_set->hits);
+        kfree(monitor->filter_set);
+    }
+    usb_monitor_free_cpus();
+    vfree(monitor->ring);
     kfree(monitor);
 }
 
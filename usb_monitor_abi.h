@@ -0,0 +1,232 @@
+/**
+    Binary interface between usb_driver.c and the user space monitor
+    @file usb_monitor_abi.h
+    @author Wang Taorui
+    @version 2022/8/14
+
+    Included by both sides. Every layout change must bump
+    USB_MONITOR_ABI_VERSION; user space checks it with CMD_GET_ABI before
+    reading any record.
+
+    The driver zeroes every record before filling it, so reserved fields
+    are guaranteed zero. A field taken out of a reserved one keeps the
+    version only if zero is what it meant before: a consumer built earlier
+    reads the same zero, one built later sees zero from an older driver and
+    takes it as the default. flaps, once reserved1, is such a field; zero
+    means the record was not coalesced. Anything else bumps the version.
+*/
+#ifndef __USB_MONITOR_ABI_H_
+#define __USB_MONITOR_ABI_H_
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define USB_MONITOR_ABI_VERSION     5
+
+#define USB_MONITOR_NAME_LENG       32
+#define USB_MONITOR_SERIAL_LENG     32
+
+
+/*
+ * One message as returned by read() and stored in the mmap'd ring.
+ * Fixed size and explicitly padded, so a batch buffer is an array of records.
+ * Everything a consumer usually looks up in sysfs is captured from the
+ * struct usb_device when the event is recorded.
+ */
+struct usb_message_t {
+    __s64 kernel_time;                          // 0:   ktime_get() in ns;
+    __u8  plug_flag;                            // 8:   1 means insert usb,0 means unplug usb;
+    __u8  speed;                                // 9:   enum usb_device_speed;
+    __u8  devnum;                               // 10:  Device number on the bus;
+    __u8  device_class;                         // 11:  bDeviceClass;
+    __u16 busnum;                               // 12:  Bus number;
+    __u16 reserved0;                            // 14:  zero;
+    __u16 vendor;                               // 16:  idVendor;
+    __u16 product;                              // 18:  idProduct;
+    __u16 bcd_device;                           // 20:  bcdDevice;
+    __u16 flaps;                                // 22:  Was reserved1, zero from the driver, set by the user-space debouncer;
+    __u64 sequence;                             // 24:  Counts every event that passed the filters,
+                                                //      a gap is the number of events dropped;
+    char  usb_name[USB_MONITOR_NAME_LENG];      // 32:  Product string, always zero terminated;
+    char  serial[USB_MONITOR_SERIAL_LENG];      // 64:  Serial number string, always zero terminated;
+    __u8  reserved3[32];                        // 96:  zero;
+} __attribute__((packed));                      // 128 bytes;
+
+
+/*
+ * Header of the circular queue, shared with user space through mmap.
+ * The indexes run freely and are masked on access, so write - read is the
+ * number of recorded data. The module only ever writes the write and claim
+ * addresses, the mmap user only ever writes the read address; read() users
+ * each have their own cursor in the module instead.
+ *
+ * The header is mapped on its own at offset 0 and may be writable; the
+ * messages are mapped at message_offset and only read only. With a single
+ * read address the mapping is one reader: only one open file may have
+ * either mapped at a time, mmap() from another fails with EBUSY until it
+ * has unmapped both. Other readers use read().
+ *
+ * The queue never waits for a reader: when full it overwrites the oldest
+ * message. A reader more than message_buffer_size behind the write address
+ * has been lapped and goes on from write - message_buffer_size. A message
+ * copied out of the mapping at index i is whole only if the claim address,
+ * read after the copy, is at most i + message_buffer_size; the module
+ * claims a slot before it overwrites it.
+ */
+struct usb_monitor_ring_t {
+    __u32  usb_message_index_write;     // Write adress, published by the module;
+    __u32  usb_message_index_claim;     // Slots below it may be being written, moved before each one;
+    __u32  reserved0[14];               // Keep the two addresses on separate cache lines;
+    __u32  usb_message_index_read;      // Read adress, advanced by the consumer;
+    __u32  reserved1[15];
+    __u32  message_buffer_size;         // Number of messages in the queue;
+    __u32  message_size;                // sizeof(struct usb_message_t);
+    __u32  message_offset;              // mmap() offset of the messages, a multiple of the page size;
+};
+
+
+/*
+ * Handshake for CMD_GET_ABI: user space fills in what it was built
+ * against, the module overwrites it with its own values and fails with
+ * EPROTO if the two do not match.
+ */
+struct usb_monitor_abi_t {
+    __u32  version;                     // USB_MONITOR_ABI_VERSION;
+    __u32  message_size;                // sizeof(struct usb_message_t);
+    __u32  message_buffer_size;         // Number of messages in the queue;
+    __u32  reserved;
+};
+
+
+/*
+ * Filters installed with CMD_SET_FILTERS and evaluated in the notifier
+ * callback, so unwanted events never reach the queue. With no filter
+ * installed every event is recorded; otherwise an event is recorded only
+ * if it matches at least one filter, and the first one it matches counts
+ * the hit. A filter matches when every field selected in match is equal.
+ */
+#define USB_MONITOR_MAX_FILTERS         16
+
+#define USB_MONITOR_MATCH_VENDOR        (1 << 0)    // idVendor;
+#define USB_MONITOR_MATCH_PRODUCT       (1 << 1)    // idProduct;
+#define USB_MONITOR_MATCH_CLASS         (1 << 2)    // Device class or any interface class;
+#define USB_MONITOR_MATCH_BUS           (1 << 3)    // Bus number;
+#define USB_MONITOR_MATCH_HUB           (1 << 4)    // Device number of the parent hub;
+#define USB_MONITOR_MATCH_NAME_PREFIX   (1 << 5)    // Product string starts with name_prefix;
+
+struct usb_monitor_filter_t {
+    __u32  match;                               // USB_MONITOR_MATCH_* fields compared;
+    __u16  vendor;
+    __u16  product;
+    __u8   device_class;
+    __u8   hub_devnum;
+    __u16  busnum;
+    __u32  reserved;
+    char   name_prefix[USB_MONITOR_NAME_LENG];  // Zero terminated;
+    __u64  hits;                                // Set by the module, ignored by CMD_SET_FILTERS;
+};
+
+struct usb_monitor_filters_t {
+    __u32  count;                               // Filters in use, 0 records everything;
+    __u32  reserved;
+    __u64  rejected;                            // Events matching no filter, set by the module;
+    struct usb_monitor_filter_t filter[USB_MONITOR_MAX_FILTERS];
+};
+
+
+/*
+ * Counters returned by CMD_GET_STATS. Every event that passes the filters
+ * takes the next sequence number and is then either recorded in the buffer
+ * of its CPU or dropped because that is full, so sequence == recorded +
+ * dropped once the producers are idle. The buffers are moved to the queue
+ * in sequence order whenever a reader asks or one of them fills up, so
+ * they only drop under a burst faster than that.
+ */
+struct usb_monitor_stats_t {
+    __u64  sequence;                    // Sequence number of the next event;
+    __u64  recorded;                    // Events written to the queue;
+    __u64  dropped;                     // Events lost because a per-CPU buffer was full;
+    __u64  filtered;                    // Events matching no filter;
+};
+
+
+/*
+ * Hot path counters returned by CMD_GET_COUNTERS and shown in
+ * /proc/usb_monitor_stats. The module keeps one copy per CPU and sums them
+ * when asked, so counting costs no lock and no shared cache line.
+ */
+struct usb_monitor_counters_t {
+    __u64  notifier_calls;              // Device add and remove callbacks;
+    __u64  wakeups;                     // Wake ups of the readers after a record;
+    __u64  reads;                       // read() calls;
+    __u64  empty_reads;                 // read() calls that found nothing, -EAGAIN;
+    __u64  partial_reads;               // read() calls that left records behind for lack of room;
+    __u64  bytes_copied;                // By read() to user space;
+    __u64  polls;                       // poll() calls;
+    __u64  ioctls;                      // ioctl() calls;
+};
+
+
+/*
+ * State of the calling file's cursor, returned by CMD_GET_CURSOR. Every
+ * open file of /proc/usb_monitor reads the whole stream at its own pace;
+ * one that falls a whole queue behind is lapped and skips to the oldest
+ * message left. missed counts those for read(); a reader of the mapping
+ * sees them only as a gap in the sequence numbers.
+ */
+struct usb_monitor_cursor_t {
+    __u64  missed;                      // Messages skipped by lapping since open;
+    __u32  unread;                      // Messages in the queue left to read;
+    __u32  readers;                     // Open files of /proc/usb_monitor;
+};
+
+
+/*
+ * Queue sizes in messages, set with the ring_size module parameter or
+ * CMD_SET_RING_SIZE; other sizes are rounded up to a power of two within
+ * these limits. CMD_SET_RING_SIZE returns the size in effect and fails with
+ * EBUSY if another open file has messages left to read or anyone has the
+ * queue mapped. What the calling file had left is dropped and counted in
+ * its usb_monitor_cursor_t.missed.
+ */
+#define USB_MONITOR_MIN_RING_SIZE       16
+#define USB_MONITOR_MAX_RING_SIZE       (1 << 20)
+
+
+/*
+ * Synthetic load for CMD_STRESS, CAP_SYS_ADMIN only. One kernel thread per
+ * online CPU records events_per_cpu events, at most 1 << 24, through the
+ * same lockless per-CPU path as the notifier, all started together and as
+ * fast as they can. With USB_MONITOR_STRESS_SERIALIZE every producer also
+ * takes one shared spinlock around the record, as all of them did before
+ * the per-CPU buffers, so the two can be compared. Readers get the events
+ * like real ones, named "stress-cpuN" and skipping the filters, so the
+ * order of the sequence numbers can be checked on the other side. The
+ * module fills in everything after flags when the run is over.
+ */
+#define USB_MONITOR_STRESS_SERIALIZE    (1 << 0)
+
+struct usb_monitor_stress_t {
+    __u32  events_per_cpu;
+    __u32  flags;                       // USB_MONITOR_STRESS_*;
+    __u32  cpus;                        // Producer threads run;
+    __u32  reserved;
+    __u64  recorded;                    // Events staged;
+    __u64  dropped;                     // Events lost because a per-CPU buffer was full;
+    __u64  elapsed_ns;                  // From the start of the producers to the end of the last;
+    __u64  producer_ns;                 // Time spent recording, summed over the producers;
+    __u64  contended;                   // Serialized records that found the lock taken;
+};
+
+
+#define CMD_GET_STATUS	_IOR(0xFF, 123, unsigned char)
+#define CMD_GET_ABI	_IOWR(0xFF, 124, struct usb_monitor_abi_t)
+#define CMD_SET_FILTERS	_IOW(0xFF, 125, struct usb_monitor_filters_t)
+#define CMD_GET_FILTERS	_IOR(0xFF, 126, struct usb_monitor_filters_t)
+#define CMD_GET_STATS	_IOR(0xFF, 127, struct usb_monitor_stats_t)
+#define CMD_GET_COUNTERS	_IOR(0xFF, 128, struct usb_monitor_counters_t)
+#define CMD_SET_RING_SIZE	_IOWR(0xFF, 129, __u32)
+#define CMD_STRESS	_IOWR(0xFF, 130, struct usb_monitor_stress_t)
+#define CMD_GET_CURSOR	_IOR(0xFF, 131, struct usb_monitor_cursor_t)
+
+#endif